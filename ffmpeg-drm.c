@@ -33,10 +33,15 @@
  *
  */
 
+#define _GNU_SOURCE             /* CPU affinity, RUSAGE_THREAD */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -44,17 +49,32 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
 #include <drm_fourcc.h>
 #include <sys/time.h>
+#include <time.h>
 #include <getopt.h>
 
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavdevice/avdevice.h>
 #include <libavutil/hwcontext_drm.h>
+#include <libavutil/pixdesc.h>
 #include <libavutil/pixfmt.h>
+#include <libavutil/crc.h>
+#include <libavutil/opt.h>
+#include <libswscale/swscale.h>
 
 #define ALIGN(x, a)             ((x) + (a - 1)) & (~(a - 1))
 #define DRM_ALIGN(val, align)   ((val + (align - 1)) & ~(align - 1))
@@ -66,6 +86,60 @@
 #endif
 
 #define _USE_V4L2_ 0
+#define _DEBUG_ALLOC_ 0         /* count the playback thread's heap allocations once playing (glibc) */
+#define _USE_TRACE_ 1           /* per-frame timeline, enabled at run time with --trace */
+
+#define TRACE_MAX_THREADS 8
+#define TRACE_RECORDS   65536   /* per thread, oldest records are overwritten */
+
+#define TRICK_KEYFRAME_RATE 8   /* from this speed on only keyframes are decoded */
+#define TRICK_MAX_RATE  64
+#define TRICK_GOP_MAX   16      /* decoded frames held for reverse playback */
+#define TRICK_MAX_WAIT  500000  /* longest pacing sleep, microseconds */
+
+#define OSD_GLYPH_W     5
+#define OSD_GLYPH_H     7
+#define OSD_MAX_DAMAGE  8
+#define OSD_MAX_LINES   4
+#define OSD_MAX_CHARS   64
+#define OSD_FOREGROUND  0xffffffff      /* ARGB8888 */
+#define OSD_BACKGROUND  0xa0000000
+
+#define RESYNC_REOPEN_AFTER 3   /* decoder failures in a row before it is reopened */
+#define RESYNC_MAX_READ_ERRORS 100      /* read failures in a row before giving up */
+#define RESYNC_READ_BACKOFF_MIN 2       /* milliseconds, doubled per failure in a row */
+#define RESYNC_READ_BACKOFF_MAX 200
+#define RESYNC_MAX_FRAMES 50    /* packets or concealed pictures dropped in a row while resyncing */
+#define RESYNC_TIMEOUT 2000     /* milliseconds, same bound: intra refresh streams have no keyframe */
+
+#define RT_DEFAULT_PRIORITY 50
+#ifndef MCL_ONFAULT
+#define MCL_ONFAULT     4       /* Linux 4.4 */
+#endif
+
+#define BENCH_FRAMES    240     /* per generated stream */
+#define BENCH_FPS       30
+#define BENCH_MAX_STREAMS 16
+
+#define MMAP_IO_BUFFER  (256 * 1024)    /* AVIOContext buffer over the mapping */
+#define MMAP_READAHEAD_SECONDS 2
+#define MMAP_READAHEAD_MIN (1 << 20)
+#define MMAP_READAHEAD_MAX (64 << 20)
+
+#define SW_BUFFERS      3       /* software frames: on screen, being replaced, being written */
+#define WB_BUFFERS      2
+#define WB_FENCE_TIMEOUT 1000   /* milliseconds */
+#define WB_MISMATCH_EXIT 2      /* exit status when captures differ from the golden file */
+
+#define SHARE_VERSION   1       /* coordinator protocol, both sides run the same build */
+#define SHARE_MAX_CLIENTS 8
+#define SHARE_PLANE_PROPS 10
+
+#define METRICS_MAGIC   0x4d44524d      /* "MRDM" */
+#define METRICS_VERSION 3
+
+#define DRM_BUF_POOL_SIZE 4     /* bufs[0], bufs[1], one being imported, one spare */
+#define DISPLAY_HELD_FRAMES 2   /* decoder pictures referenced by bufs[0] and bufs[1] */
 
 struct drm_buffer {
     unsigned int fourcc;
@@ -75,6 +149,11 @@ struct drm_buffer {
     uint32_t offsets[AV_DRM_MAX_PLANES];
     uint64_t modifiers[AV_DRM_MAX_PLANES];
     uint32_t bo_handles[AV_DRM_MAX_PLANES];
+    size_t size;                /* dma-buf bytes imported, for accounting */
+    int dumb;                   /* fb_handle belongs to a dumb_buffer, nothing imported */
+    AVFrame *frame;             /* decoder picture, kept out of the decoder's reach while on screen */
+    struct drm_buffer *next;    /* free list link */
+    int64_t pts;
 };
 
 struct drm_dev {
@@ -92,10 +171,229 @@ struct drm_dev {
     struct drm_buffer *bufs[2]; // double buffering
 };
 
+/*
+ * Input profile: probing and decoder settings tuned per class of input.
+ * PROFILE_AUTO derives the value from container, codec and resolution,
+ * 0 keeps the library default.
+ */
+#define PROFILE_AUTO    -1
+
+struct input_profile {
+    const char *name;
+    int64_t probesize;          /* bytes */
+    int64_t analyzeduration;    /* microseconds */
+    int capture_buffers;
+    int threads;
+};
+
+struct dumb_buffer {
+    uint32_t handle, pitch, fb;
+    uint64_t size;
+    uint32_t *map;
+};
+
+struct osd_rect {
+    int x, y, w, h;
+};
+
+/*
+ * Shared display: one datagram per message on a SOCK_SEQPACKET socket.
+ * A frame carries the dma-buf fds of desc.objects as SCM_RIGHTS, the fds
+ * in desc itself are the sender's and are replaced on reception.
+ */
+enum share_type {
+    SHARE_HELLO,                /* worker: version */
+    SHARE_WELCOME,              /* coordinator: screen size and refresh */
+    SHARE_FRAME,                /* worker: picture and where to show it */
+    SHARE_PRESENTED,            /* coordinator: on screen since the flip */
+    SHARE_DROPPED,              /* coordinator: not shown, the previous picture stays up */
+};
+
+struct share_msg {
+    uint32_t type;
+    uint32_t version;
+    uint32_t width, height;     /* WELCOME: screen, FRAME: picture */
+    uint32_t vrefresh;
+    uint32_t fourcc;
+    int32_t crtc_x, crtc_y;
+    uint32_t crtc_w, crtc_h;
+    int64_t pts;
+    AVDRMFrameDescriptor desc;
+    uint32_t sequence, tv_sec, tv_usec;
+};
+
+/* a worker as seen by the coordinator */
+struct share_client {
+    int fd;                     /* -1: slot free */
+    int hello;
+    uint32_t plane_id;          /* taken with the first frame */
+    uint32_t props[SHARE_PLANE_PROPS];
+    struct drm_buffer bufs[3];
+    struct drm_buffer *pending; /* received, goes in the next commit */
+    struct drm_buffer *queued;  /* part of the commit in flight */
+    struct drm_buffer *shown;
+    struct share_msg frame;     /* geometry of pending */
+    int in_flight;
+    int gone;                   /* disconnected: its plane is disabled by the next commit */
+};
+
+struct osd_text {
+    char lines[OSD_MAX_LINES][OSD_MAX_CHARS + 1];
+    int nb_lines;
+    int scale;
+    struct osd_rect box;
+};
+
+/* how every input is opened, shared by the active and the standby pipeline */
+struct player_config {
+    const char *device;
+    const AVInputFormat *ifmt;
+    int v4l2;
+    const char *pixel_format, *size_window;
+    unsigned int frame_width, frame_height;
+    const struct input_profile *profile;
+    int64_t probesize, analyzeduration;
+    int capture_buffers, threads;
+    int mmap_io;                /* local files through a mapping */
+    const char *codec_name;     /* explicit decoder */
+    const char *backend;        /* NULL/"auto", "software" or a decoder suffix: "rkmpp" */
+};
+
+/* a local file read from a mapping instead of read() calls */
+struct mmap_input {
+    int fd;
+    uint8_t *data;
+    int64_t map_size;
+    int64_t size;               /* readable, less than map_size once the file shrank */
+    int64_t pos;
+    int64_t readahead_end;      /* advised up to here */
+    int64_t window;             /* readahead size, from the bitrate */
+    AVIOContext *avio;
+    unsigned int reads, seeks;
+};
+
+enum pipeline_state {
+    PIPELINE_LOADING,
+    PIPELINE_READY,
+    PIPELINE_FAILED,
+};
+
+/*
+ * Demuxer + decoder for one input. A standby pipeline is opened and
+ * pre-rolled (first picture decoded) on its own thread, so switching to it
+ * only costs the import and one atomic commit.
+ */
+struct pipeline {
+    char *url;
+    AVFormatContext *input_ctx;
+    struct mmap_input *mmap;    /* NULL: libavformat's own I/O */
+    AVCodecContext *codec_ctx;
+    AVFrame *frame;
+    AVFrame *preroll;           /* first picture, shown on switch */
+    int video_stream;
+    int sub_stream;             /* -1 without subtitles */
+    AVCodecContext *sub_ctx;
+    double fps;
+    int capture_buffers;
+    int threads;                /* 0: library default */
+    int64_t pool_bytes;         /* capture pool accounted in mem.pool */
+    int64_t mem_available;      /* budget left when the load started */
+    int pool_measured;
+    int accounted;
+    int background;             /* opened by a pre-roll thread */
+    pthread_t thread;
+    atomic_int state;
+    atomic_int abort;
+};
+
+/* startup latency of each pipeline stage, CLOCK_MONOTONIC microseconds */
+struct startup_timing {
+    int64_t start;
+    int64_t open;
+    int64_t probe;
+    int64_t codec_open;
+    int64_t first_packet;
+    int64_t first_frame;
+    int64_t first_flip;
+    int reported;
+};
+
+enum trace_event {
+    TRACE_READ,
+    TRACE_SEND,
+    TRACE_RECEIVE,
+    TRACE_IMPORT,
+    TRACE_ADDFB,
+    TRACE_COMMIT,
+    TRACE_FLIP,
+    TRACE_NB
+};
+
+struct trace_record {
+    int64_t ts;                 /* CLOCK_MONOTONIC nanoseconds */
+    int64_t dur;
+    int64_t pts;
+    int event;
+};
+
+/*
+ * Single producer ring: only the owning thread writes, head is published
+ * with release after the record is filled. The dumper copies a record and
+ * then re-reads head: if the owner has wrapped onto it meanwhile, the copy
+ * is discarded.
+ */
+struct trace_buffer {
+    struct trace_record records[TRACE_RECORDS];
+    atomic_uint head;
+    int tid;
+};
+
+/*
+ * Live counters, optionally placed in a POSIX shared memory object so a
+ * monitoring agent can read them. Writers only use relaxed atomics and
+ * readers map the block read-only: nothing can block playback.
+ */
+struct metrics {
+    uint32_t magic;
+    uint32_t version;
+    int32_t pid;
+    _Atomic uint64_t frames_decoded;
+    _Atomic uint64_t frames_presented;
+    _Atomic uint64_t missed_vblanks;
+    _Atomic uint64_t send_errors;
+    _Atomic uint64_t decode_errors;
+    _Atomic uint64_t bitrate;           /* bits per second over the last second */
+    _Atomic uint64_t last_flip_us;      /* CLOCK_MONOTONIC, from the flip event */
+    _Atomic uint32_t display_queue;     /* frames held by the display ring */
+    _Atomic uint32_t drm_buffers;       /* drm_buffer records in use */
+    _Atomic uint64_t corrupt_frames;    /* decoded with errors, not shown */
+    _Atomic uint64_t read_errors;
+    _Atomic uint64_t commit_errors;
+    _Atomic uint64_t resyncs;           /* waits for a keyframe after a decoder failure */
+    _Atomic uint64_t decoder_reopens;
+    _Atomic uint64_t preemptions;       /* involuntary context switches of the playback thread */
+};
+
+/*
+ * dma-buf / CMA memory held by this process, in bytes. The imported
+ * buffers live inside the decoder pool, so the total is pool + dumb.
+ */
+
+struct mem_stats {
+    int64_t pool, pool_peak;            /* decoder capture pool */
+    int64_t imported, imported_peak;    /* objects held by drm_buffer records */
+    int64_t dumb, dumb_peak;            /* dumb buffers (OSD, software frames, writeback) */
+    int64_t peak;
+    int64_t budget;                     /* 0: unlimited */
+    int64_t report_interval;            /* microseconds, 0: only at exit */
+    int64_t last_report;
+    int capture_buffers;                /* of the active pipeline */
+    int over_budget;
+};
+
 
 enum AVPixelFormat get_format(AVCodecContext * Context, const enum AVPixelFormat *PixFmt);
 uint32_t get_property_id(const char *name);
-void set_plane_transparent(int plane_id);
 int drm_get_plane_props(int fd, uint32_t id);
 int drm_add_property(const char *name, uint64_t value);
 int drm_dmabuf_set_plane(struct drm_buffer *buf, uint32_t width, uint32_t height, int fullscreen, AVRational sar);
@@ -103,7 +401,210 @@ void show_help_default(const char *opt, const char *arg);
 
 static struct drm_dev *pdev;
 static unsigned int drm_format;
-static int disable_plane_id = 0;
+static int osd_plane_id = 0;
+static struct startup_timing timing;
+static struct pipeline *active, *standby;
+static struct player_config config;
+static int paused, switch_pending, step_frames;
+static int null_display;        /* decode only: pictures are counted, not shown */
+
+/*
+ * Trick play. Outside of 1x, presentation follows a media clock running
+ * at <rate> times real time, anchored on the last displayed picture.
+ * Timestamps are in AV_TIME_BASE units.
+ */
+static struct {
+    int rate;
+    int64_t base_pts;           /* media time at base_wall */
+    int64_t base_wall;
+    int64_t last_pts;           /* last displayed picture */
+    int64_t segment_end;        /* reverse: everything before was shown */
+    int64_t skip_until;         /* after a seek: decoded but not shown */
+    int64_t sought_pts;         /* keyframe mode: keyframe seeked to, not shown yet */
+    int anchored;               /* base_pts follows a displayed picture */
+    AVFrame *gop[TRICK_GOP_MAX];        /* reverse: decoded, not yet shown */
+    int gop_count;
+} trick = {.rate = 1, .skip_until = INT64_MIN, .sought_pts = INT64_MIN };
+
+static struct {
+    uint32_t plane_id;          /* 0: no OSD */
+    uint32_t width, height;
+    int scale;                  /* font pixel size */
+    struct dumb_buffer bufs[2];
+    int front;                  /* buffer on screen */
+    int fb_pending;             /* back buffer goes in the next commit */
+    int setup;                  /* plane geometry not committed yet */
+    struct osd_rect damage[OSD_MAX_DAMAGE];     /* changed, not rendered yet */
+    int nb_damage;
+    struct osd_rect prev[OSD_MAX_DAMAGE];       /* rendered in the front buffer only */
+    int nb_prev;
+    struct {
+        AVSubtitle sub;
+        int valid, shown;
+        int canvas_w, canvas_h;
+        int64_t start, end;
+        struct osd_rect box;
+        struct osd_text text;
+    } sub;
+    int status_enabled;
+    struct osd_text status;
+} osd;
+
+/*
+ * Decoder errors: abort playback, or flush the decoder, drop packets up
+ * to the next keyframe and keep the last good picture on screen. Both the
+ * keyframe wait and dropping concealed pictures are bounded, so a stream
+ * that never recovers cleanly is shown again, concealment and all.
+ */
+enum {
+    ERRORS_ABORT,
+    ERRORS_RESYNC,
+};
+
+static struct {
+    int policy;
+    int reopen_after;           /* 0: never reopen the decoder */
+    int failures;               /* in a row, reset by a good picture */
+    int read_failures;
+    int read_backoff;           /* ms before the next read */
+    int waiting_key;
+    int64_t key_since;          /* waiting_key: when the wait started */
+    int key_skipped;
+    int64_t hide_since;         /* first concealed picture dropped, 0: pictures are shown */
+    int hidden;
+} resync = {.policy = ERRORS_RESYNC, .reopen_after = RESYNC_REOPEN_AFTER };
+
+/*
+ * CPU placement and real-time policy. The playback thread demuxes, drives
+ * the decoder and commits; libavcodec's worker threads are created when
+ * the decoder is opened and inherit the opening thread's settings; pre-roll
+ * and release run on background threads.
+ */
+static struct {
+    cpu_set_t playback, decoder, background;
+    int has_playback, has_decoder, has_background;
+    int policy;                 /* SCHED_OTHER: unchanged */
+    int priority;
+    int mlock;
+    int locked;
+} rt = {.policy = SCHED_OTHER };
+
+/* decoders without DRM PRIME output: frames converted into XRGB8888 dumb buffers */
+static struct {
+    struct dumb_buffer bufs[SW_BUFFERS];
+    int next;
+    int width, height;
+    struct SwsContext *sws;
+} sw;
+
+/* display mode chosen for the content, applied with the first commit */
+static struct {
+    int match_rate;
+    unsigned int width, height; /* 0: keep the connector's preferred size */
+    int vrr;                    /* requested */
+    int vrr_active;
+    int pace;                   /* 1x follows the media clock, not one frame per vblank */
+    uint32_t mode_blob;         /* 0: keep the current mode */
+    int pending;                /* CRTC properties go in the next commit */
+    uint32_t prop_mode_id, prop_active, prop_vrr, prop_conn_crtc;
+} modeset;
+
+/*
+ * Writeback capture: every presented frame is also written by the CRTC
+ * into a dumb buffer, hashed and optionally dumped or checked against a
+ * golden file, e.g. on vkms.
+ */
+static struct {
+    int enabled;
+    uint32_t conn_id;
+    uint32_t prop_crtc, prop_fb, prop_fence;
+    struct dumb_buffer bufs[WB_BUFFERS];
+    int next;
+    int setup;                  /* connector not bound to the CRTC yet */
+    int32_t fence;              /* written by the kernel at commit */
+    int queued;                 /* bufs[next] is part of the last commit */
+    unsigned int frame;
+    const char *hash_file;
+    FILE *hashes;
+    const char *golden_file;
+    uint32_t *golden;
+    unsigned int nb_golden;
+    unsigned int mismatches;
+    const char *dump_dir;
+    const char *dump_frames;    /* NULL: every frame */
+    uint8_t *dump_row;
+} wb = {.fence = -1 };
+
+static struct {
+    const char *path;
+    int listen_fd;
+    int client_fd;
+    char buf[1024];
+    size_t len;
+} control = {.listen_fd = -1, .client_fd = -1 };
+
+/*
+ * Shared display. The coordinator is DRM master and owns one CRTC; each
+ * worker decodes in its own process, sends its DRM PRIME frames over a
+ * Unix socket and gets a plane of its own. Frames received during a
+ * vblank interval are committed together.
+ */
+static struct {
+    const char *listen_path;    /* coordinator */
+    int listen_fd;
+    mode_t mode;                /* socket permissions, 0: from the umask */
+    struct share_client clients[SHARE_MAX_CLIENTS];
+    int flip_pending;
+    const char *connect_path;   /* worker */
+    int fd;                     /* worker: -1, the display is our own */
+    int32_t x, y;
+    uint32_t w, h;              /* region, 0: the whole screen */
+    uint32_t vrefresh;
+    AVFrame *shown;             /* worker: on screen, the decoder must not reuse it */
+} share = {.listen_fd = -1, .fd = -1 };
+static volatile sig_atomic_t share_stop;
+static struct mem_stats mem;
+
+static struct drm_buffer drm_buf_pool[DRM_BUF_POOL_SIZE];
+static struct drm_buffer *drm_buf_free;
+static unsigned int pool_misses;        /* drm_buffer records taken from the heap */
+
+static const char *const trace_names[TRACE_NB] = {
+    [TRACE_READ] = "read",
+    [TRACE_SEND] = "send_packet",
+    [TRACE_RECEIVE] = "receive_frame",
+    [TRACE_IMPORT] = "fd_import",
+    [TRACE_ADDFB] = "addfb",
+    [TRACE_COMMIT] = "commit",
+    [TRACE_FLIP] = "flip",
+};
+
+static int trace_enabled;
+static const char *trace_file;
+static volatile sig_atomic_t trace_dump_requested;
+static struct trace_buffer *_Atomic trace_buffers[TRACE_MAX_THREADS];
+static atomic_int trace_nb_buffers;
+static __thread struct trace_buffer *trace_local;
+
+static struct metrics metrics_local;
+static struct metrics *metrics = &metrics_local;
+static char metrics_name[64];
+static double content_fps;
+static unsigned int last_flip_sequence;
+static double flip_phase;       /* vblanks the next flip is due after refresh / fps, past the last one */
+static int64_t bitrate_window_start, bitrate_window_bytes;
+
+static const struct input_profile input_profiles[] = {
+    /* name           probesize     analyzeduration  buffers       threads */
+    { "auto",         PROFILE_AUTO, PROFILE_AUTO,    PROFILE_AUTO, PROFILE_AUTO },
+    { "legacy",       0,            0,               32,           0 },
+    { "low-latency",  65536,        100000,          PROFILE_AUTO, PROFILE_AUTO },
+};
+
+/* demuxers without a container: probing has to parse the bitstream itself */
+static const char *const raw_demuxers[] = {
+    "h264", "hevc", "vvc", "obu", "mpegvideo", "m4v", "vc1", "cavsvideo", NULL
+};
 
 const char program_name[] = "ffmpeg-drm";
 const int program_birth_year = 2003;
@@ -128,664 +629,5139 @@ void show_help_default(const char *opt, const char *arg)
 {
 }
 
-enum AVPixelFormat get_format(AVCodecContext * Context, const enum AVPixelFormat *PixFmt)
+static int64_t monotonic_us(void)
 {
-    while (*PixFmt != AV_PIX_FMT_NONE) {
-        if (*PixFmt == AV_PIX_FMT_DRM_PRIME)
-            return AV_PIX_FMT_DRM_PRIME;
-        PixFmt++;
-    }
-    return AV_PIX_FMT_NONE;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
+#define timing_mark(stage)                                              \
+        do {                                                            \
+                if (!timing.stage)                                      \
+                        timing.stage = monotonic_us();                  \
+        } while (0)
 
-uint32_t get_property_id(const char *name)
+static void timing_report(void)
 {
-    uint32_t i;
+    if (timing.reported || !timing.first_flip)
+        return;
+    timing.reported = 1;
+
+    info("startup: open %lld us, probe %lld us, codec open %lld us, first packet %lld us, "
+         "first frame %lld us, first flip %lld us (total %lld us)",
+         (long long) (timing.open - timing.start),
+         (long long) (timing.probe - timing.open),
+         (long long) (timing.codec_open - timing.probe),
+         (long long) (timing.first_packet - timing.codec_open),
+         (long long) (timing.first_frame - timing.first_packet),
+         (long long) (timing.first_flip - timing.first_frame),
+         (long long) (timing.first_flip - timing.start));
+}
 
-    for (i = 0; i < pdev->count_props; ++i)
-        if (!strcmp(pdev->props[i]->name, name))
-            return pdev->props[i]->prop_id;
+static const struct input_profile *find_input_profile(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(input_profiles) / sizeof(input_profiles[0]); i++)
+        if (!strcmp(input_profiles[i].name, name))
+            return &input_profiles[i];
+
+    return NULL;
+}
+
+static int is_raw_demuxer(const AVInputFormat *iformat)
+{
+    int i;
+
+    if (!iformat)
+        return 0;
+
+    for (i = 0; raw_demuxers[i]; i++)
+        if (!strcmp(iformat->name, raw_demuxers[i]))
+            return 1;
 
     return 0;
 }
 
-void set_plane_transparent(int plane_id)
+/* H.264 table A-1: MaxDpbMbs per level_idc */
+static int h264_max_dpb_mbs(int level)
 {
-    struct drm_mode_create_dumb creq;
-    struct drm_mode_map_dumb mreq;
-    uint32_t fb;
-    int ret;
-    void *map;
-    int handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+    if (level <= 11)
+        return level == 11 ? 900 : 396;
+    if (level <= 20)
+        return 2376;
+    if (level <= 21)
+        return 4752;
+    if (level <= 30)
+        return 8100;
+    if (level <= 31)
+        return 18000;
+    if (level <= 32)
+        return 20480;
+    if (level <= 41)
+        return 32768;
+    if (level <= 42)
+        return 34816;
+    if (level <= 50)
+        return 110400;
+    if (level <= 52)
+        return 184320;
+    return 696320;
+}
 
-    /* create dumb buffer */
-    memset(&creq, 0, sizeof(creq));
-    creq.width = pdev->width;
-    creq.height = pdev->height;
-    creq.bpp = 32;
-    ret = drmIoctl(pdev->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
-    if (ret < 0) {
-        err("DRM_IOCTL_MODE_CREATE_DUMB fail\n");
-        return;
-    }
-    /* creq.pitch, creq.handle and creq.size are filled by this ioctl with
-     * the requested values and can be used now. */
+/* HEVC table A.8: MaxLumaPs per general_level_idc (30 x level) */
+static int64_t hevc_max_luma_ps(int level)
+{
+    if (level <= 30)
+        return 36864;
+    if (level <= 60)
+        return 122880;
+    if (level <= 63)
+        return 245760;
+    if (level <= 90)
+        return 552960;
+    if (level <= 93)
+        return 983040;
+    if (level <= 123)
+        return 2228224;
+    if (level <= 156)
+        return 8912896;
+    return 35651584;
+}
 
-    /* the framebuffer "fb" can now used for scanout with KMS */
+/* worst case reference frames allowed by the level, 16 when unknown below 4K */
+static int profile_dpb_frames(const AVCodecParameters * par)
+{
+    int64_t samples = (int64_t) par->width * par->height;
+    int64_t max_luma_ps;
+    int mbs;
 
-    /* prepare buffer for memory mapping */
-    memset(&mreq, 0, sizeof(mreq));
-    mreq.handle = creq.handle;
-    ret = drmIoctl(pdev->fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
-    if (ret) {
-        err("DRM_IOCTL_MODE_MAP_DUMB fail\n");
-        return;
-    }
-    /* mreq.offset now contains the new offset that can be used with mmap() */
+    if (par->level <= 0 || !samples)
+        return samples >= 3840 * 2160 ? 6 : 16;
 
-    /* perform actual memory mapping */
-    map = mmap(0, creq.size, PROT_READ | PROT_WRITE, MAP_SHARED, pdev->fd, mreq.offset);
-    if (map == MAP_FAILED) {
-        err("mmap fail\n");
-        return;
+    if (par->codec_id == AV_CODEC_ID_H264) {
+        mbs = ((par->width + 15) / 16) * ((par->height + 15) / 16);
+        return av_clip(h264_max_dpb_mbs(par->level) / mbs, 1, 16);
     }
 
-    /* clear the framebuffer to 0 (= full transparency in ARGB8888) */
-    memset(map, 0, creq.size);
-    munmap(map, creq.size);
+    /* HEVC 8.4.5.3.2: smaller pictures get more of the 6 frame picture buffer */
+    max_luma_ps = hevc_max_luma_ps(par->level);
+    if (samples <= max_luma_ps >> 2)
+        return 16;
+    if (samples <= max_luma_ps >> 1)
+        return 12;
+    if (samples <= (3 * max_luma_ps) >> 2)
+        return 8;
+    return 6;
+}
 
-    print("size = %llu ; pitch = %u\n", creq.size, creq.pitch);
+/*
+ * Capture buffers = worst case reference frames + the two pictures the
+ * display holds a reference on (bufs[0], bufs[1]) + two in flight inside
+ * the decoder. The H.264/HEVC DPB size follows from the level and the
+ * picture size.
+ */
+static int profile_dpb(const AVCodecParameters * par)
+{
+    int dpb;
 
-    handles[0] = creq.handle;
-    pitches[0] = creq.pitch;
-    offsets[0] = 0;
-    /* create framebuffer object for the dumb-buffer */
-    ret = drmModeAddFB2(pdev->fd, pdev->width, pdev->height, DRM_FORMAT_ARGB8888, handles, pitches, offsets, &fb, 0);
-    if (ret) {
-        print("drmModeAddFB fail\n");
-        return;
+    switch (par->codec_id) {
+    case AV_CODEC_ID_H264:
+    case AV_CODEC_ID_HEVC:
+        dpb = profile_dpb_frames(par);
+        break;
+    case AV_CODEC_ID_VP9:
+    case AV_CODEC_ID_AV1:
+        dpb = 8;
+        break;
+    default:
+        dpb = 2;
+        break;
     }
 
-    dbg("Setting FB_ID %u; width %u; height %u; plane %u\n", fb, pdev->width, pdev->height, plane_id);
+    return dpb;
+}
 
-    ret = drmModeAtomicAddProperty(pdev->req, plane_id, get_property_id("FB_ID"), fb);
-    ret = drmModeAtomicAddProperty(pdev->req, plane_id, get_property_id("SRC_X"), 0);
-    ret = drmModeAtomicAddProperty(pdev->req, plane_id, get_property_id("SRC_Y"), 0);
-    ret = drmModeAtomicAddProperty(pdev->req, plane_id, get_property_id("SRC_W"), pdev->width << 16);
-    ret = drmModeAtomicAddProperty(pdev->req, plane_id, get_property_id("SRC_H"), pdev->height << 16);
-    ret = drmModeAtomicAddProperty(pdev->req, plane_id, get_property_id("CRTC_X"), 0);
-    ret = drmModeAtomicAddProperty(pdev->req, plane_id, get_property_id("CRTC_Y"), 0);
-    ret = drmModeAtomicAddProperty(pdev->req, plane_id, get_property_id("CRTC_W"), pdev->width);
-    ret = drmModeAtomicAddProperty(pdev->req, plane_id, get_property_id("CRTC_H"), pdev->height);
+static int profile_capture_buffers(const AVCodecParameters * par)
+{
+    return profile_dpb(par) + DISPLAY_HELD_FRAMES + 2;
 }
 
-static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+/* below this the decoder waits for the display to let go of a picture */
+static int profile_min_buffers(const AVCodecParameters * par)
 {
-    // Nothing to do.
+    return profile_dpb(par) + DISPLAY_HELD_FRAMES + 1;
 }
 
-int drm_get_plane_props(int fd, uint32_t id)
+static void mem_add(int64_t *cur, int64_t *peak, int64_t delta)
 {
-    uint32_t i;
+    int64_t total;
 
-    drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, id, DRM_MODE_OBJECT_PLANE);
-    if (!props) {
-        err("drmModeObjectGetProperties failed\n");
-        return -1;
-    }
-    //print("Found %u props\n", props->count_props);
-    pdev->count_props = props->count_props;
-    for (i = 0; i < props->count_props; i++) {
-        pdev->props[i] = drmModeGetProperty(fd, props->props[i]);
-        //print("Added prop %u:%s\n", pdev->props[i]->prop_id, pdev->props[i]->name);
+    *cur += delta;
+    if (*cur > *peak)
+        *peak = *cur;
+
+    total = mem.pool + mem.dumb;
+    if (total > mem.peak)
+        mem.peak = total;
+
+    if (mem.budget && total > mem.budget && !mem.over_budget) {
+        err("memory budget exceeded: %lld KiB used, budget %lld KiB",
+            (long long) (total >> 10), (long long) (mem.budget >> 10));
+        mem.over_budget = 1;
     }
-    drmModeFreeObjectProperties(props);
+}
 
-    return 0;
+static void mem_report(void)
+{
+    info("memory: pool %lld KiB (peak %lld, %d buffers), imported %lld KiB (peak %lld), "
+         "dumb %lld KiB (peak %lld), total %lld KiB (peak %lld)",
+         (long long) (mem.pool >> 10), (long long) (mem.pool_peak >> 10), mem.capture_buffers,
+         (long long) (mem.imported >> 10), (long long) (mem.imported_peak >> 10),
+         (long long) (mem.dumb >> 10), (long long) (mem.dumb_peak >> 10),
+         (long long) ((mem.pool + mem.dumb) >> 10), (long long) (mem.peak >> 10));
 }
 
-int drm_add_property(const char *name, uint64_t value)
+static void mem_report_periodic(void)
 {
-    int ret;
-    uint32_t prop_id = get_property_id(name);
+    int64_t now;
 
-    if (!prop_id) {
-        err("Couldn't find prop %s\n", name);
-        return -1;
-    }
+    if (!mem.report_interval)
+        return;
 
-    ret = drmModeAtomicAddProperty(pdev->req, pdev->plane_id, get_property_id(name), value);
-    if (ret < 0) {
-        err("drmModeAtomicAddProperty (%s:%lu) failed: %d\n", name, value, ret);
-        return ret;
-    }
+    now = monotonic_us();
+    if (now - mem.last_report < mem.report_interval)
+        return;
 
-    return 0;
+    mem.last_report = now;
+    mem_report();
 }
 
-int drm_dmabuf_set_plane(struct drm_buffer *buf, uint32_t width, uint32_t height, int fullscreen, AVRational sar)
+/* size of one decoded picture before the decoder tells us: NV12 or packed NV15 */
+static int64_t mem_frame_size(const AVCodecParameters *par)
 {
-    int ret;
-    uint32_t crtc_w;
-    uint32_t crtc_h;
-    uint32_t crtc_x = 0;
-    uint32_t crtc_y = 0;
-    double ratio_w;
-    double ratio_h;
-
-    fd_set fds;
-    FD_ZERO(&fds);
-    FD_SET(pdev->fd, &fds);
+    const AVPixFmtDescriptor *pix = av_pix_fmt_desc_get(par->format);
+    int bits = (pix && pix->comp[0].depth > 8) ? 10 : 8;
+    int64_t stride = DRM_ALIGN((int64_t) par->width * bits / 8, 64);
 
-    if (!sar.num || !sar.den) {
-        sar.num = 1;
-        sar.den = 1;
-    }
+    return stride * DRM_ALIGN(par->height, 16) * 3 / 2;
+}
 
-    crtc_w = (width * sar.num) / sar.den;
-    crtc_h = height;
-    ratio_w = (double) pdev->width / crtc_w;
-    ratio_h = (double) pdev->height / crtc_h;
+/* budget not yet taken by dumb buffers and open pipelines, 0 if unlimited */
+static int64_t mem_available(void)
+{
+    if (!mem.budget)
+        return 0;
 
-    if (ratio_w > ratio_h) {
-        crtc_w *= ratio_h;
-        crtc_h *= ratio_h;
-        crtc_x = (pdev->width - crtc_w) / 2;
-    } else {
-        crtc_w *= ratio_w;
-        crtc_h *= ratio_w;
-        crtc_y = (pdev->height - crtc_h) / 2;
-    }
+    return mem.budget - mem.dumb - mem.pool;
+}
 
-    // print("crtc_x: %u; crtc_y:%u; crtc_w: %u; crtc_h: %u\n", crtc_x, crtc_y, crtc_w, crtc_h);
+/* shrink the capture pool so that it fits in what is left of the budget */
+static int mem_fit_buffers(int buffers, int min, int64_t frame_size, int64_t available)
+{
+    int64_t fit;
 
-    drm_add_property("FB_ID", buf->fb_handle);
-    drm_add_property("CRTC_ID", pdev->crtc_id);
-    drm_add_property("SRC_X", 0);
-    drm_add_property("SRC_Y", 0);
-    drm_add_property("SRC_W", width << 16);
-    drm_add_property("SRC_H", height << 16);
-    drm_add_property("CRTC_X", crtc_x);
-    drm_add_property("CRTC_Y", crtc_y);
-    drm_add_property("CRTC_W", crtc_w);
-    drm_add_property("CRTC_H", crtc_h);
+    if (!mem.budget || buffers <= 0 || frame_size <= 0)
+        return buffers;
 
-    if (disable_plane_id) {
-        set_plane_transparent(disable_plane_id);
-        disable_plane_id = 0;
-    }
+    fit = (available > 0 ? available : 0) / frame_size;
+    if (fit >= buffers)
+        return buffers;
 
-    ret = drmModeAtomicCommit(pdev->fd, pdev->req, DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
-    if (ret) {
-        err("drmModeAtomicCommit failed: %s\n", strerror(errno));
-        return ret;
+    /* never below references + pictures held by the display + the one being decoded */
+    min = FFMIN(min, buffers);
+    if (fit < min) {
+        err("memory budget %lld KiB too small for %d buffers of %lld KiB",
+            (long long) (mem.budget >> 10), min, (long long) (frame_size >> 10));
+        fit = min;
     }
 
-    do {
-        ret = select(pdev->fd + 1, &fds, NULL, NULL, NULL);
-    } while (ret == -1 && errno == EINTR);
-
-    if (FD_ISSET(pdev->fd, &fds))
-        drmHandleEvent(pdev->fd, &pdev->drm_event_ctx);
+    dbg("memory budget: capture buffers %d -> %d", buffers, (int) fit);
+    return fit;
+}
 
-    drmModeAtomicFree(pdev->req);
-    pdev->req = drmModeAtomicAlloc();
+static int64_t monotonic_ns(void)
+{
+    struct timespec ts;
 
-    return 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 }
 
-static int drm_dmabuf_addfb(struct drm_buffer *buf, uint32_t width, uint32_t height)
+/* first event on a thread registers its buffer; allocation happens once */
+static struct trace_buffer *trace_register(void)
 {
-    int ret;
+    struct trace_buffer *buf;
+    int idx;
 
-    width = ALIGN(width, 8);
+    idx = atomic_fetch_add(&trace_nb_buffers, 1);
+    if (idx >= TRACE_MAX_THREADS) {
+        atomic_fetch_sub(&trace_nb_buffers, 1);
+        return NULL;
+    }
 
-    ret = drmModeAddFB2WithModifiers(pdev->fd, width, height, buf->fourcc, buf->handles, buf->pitches, buf->offsets, buf->modifiers, &buf->fb_handle, 0);
-    if (ret) {
-        err("drmModeAddFB2 failed: %d (%s). width=%u, height=%u\n", ret, strerror(errno), width, height);
-        return ret;
+    buf = calloc(1, sizeof(*buf));
+    if (!buf) {
+        atomic_fetch_sub(&trace_nb_buffers, 1);
+        return NULL;
     }
+    buf->tid = syscall(SYS_gettid);
+    atomic_store_explicit(&trace_buffers[idx], buf, memory_order_release);
 
-    return 0;
+    return buf;
 }
 
-static void fcc2s(char *fmtString, unsigned int size, unsigned int pixelformat)
+static void trace_add(int event, int64_t start, int64_t pts)
 {
-    if (size < 8) {
-        fmtString[0] = '\0';
+    struct trace_buffer *buf = trace_local;
+    struct trace_record *rec;
+    unsigned int head;
+
+    if (!buf && !(buf = trace_local = trace_register()))
         return;
-    }
 
-    fmtString[0] = pixelformat & 0x7f;
-    fmtString[1] = (pixelformat >> 8) & 0x7f;
-    fmtString[2] = (pixelformat >> 16) & 0x7f;
-    fmtString[3] = (pixelformat >> 24) & 0x7f;
-    if (pixelformat & (1 << 31)) {
-        fmtString[4] = '-';
-        fmtString[5] = 'B';
+    head = atomic_load_explicit(&buf->head, memory_order_relaxed);
+    rec = &buf->records[head % TRACE_RECORDS];
+    rec->ts = start;
+    rec->dur = monotonic_ns() - start;
+    rec->pts = pts;
+    rec->event = event;
+    atomic_store_explicit(&buf->head, head + 1, memory_order_release);
+}
+
+#if _USE_TRACE_
+#define trace_begin()                   (trace_enabled ? monotonic_ns() : 0)
+#define trace_end(event, start, pts)                                    \
+        do {                                                            \
+                if (trace_enabled)                                      \
+                        trace_add(event, start, pts);                   \
+        } while (0)
+#else
+#define trace_begin()                   0
+#define trace_end(event, start, pts)    do { (void) (start); } while (0)
+#endif
+
+/* Chrome JSON trace format, loadable in Perfetto and chrome://tracing */
+static void trace_dump(void)
+{
+    struct trace_buffer *buf;
+    struct trace_record rec;
+    unsigned int head, first, n;
+    int i, sep = 0;
+    FILE *f;
+
+    trace_dump_requested = 0;
+    if (!trace_enabled || !trace_file)
+        return;
+
+    f = fopen(trace_file, "w");
+    if (!f) {
+        err("cannot open trace file '%s': %s", trace_file, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (i = 0; i < atomic_load(&trace_nb_buffers) && i < TRACE_MAX_THREADS; i++) {
+        buf = atomic_load_explicit(&trace_buffers[i], memory_order_acquire);
+        if (!buf)
+            continue;
+        head = atomic_load_explicit(&buf->head, memory_order_acquire);
+        first = head > TRACE_RECORDS ? head - TRACE_RECORDS : 0;
+        for (n = first; n != head; n++) {
+            rec = buf->records[n % TRACE_RECORDS];
+            /* the owner fills slot head before publishing it: n may be torn once head reaches n + TRACE_RECORDS */
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&buf->head, memory_order_relaxed) - n >= TRACE_RECORDS)
+                continue;
+            if (rec.event < 0 || rec.event >= TRACE_NB)
+                continue;
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+                    "\"pid\":%d,\"tid\":%d,\"args\":{\"pts\":%lld}}",
+                    sep ? ",\n" : "", trace_names[rec.event], rec.ts / 1000.0, rec.dur / 1000.0,
+                    (int) getpid(), buf->tid, (long long) rec.pts);
+            sep = 1;
+        }
+    }
+    fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    fclose(f);
+
+    info("trace written to %s", trace_file);
+}
+
+/* the dump itself is not async-signal-safe: the playback loop performs it */
+static void trace_signal(int sig)
+{
+    trace_dump_requested = 1;
+}
+
+#define metrics_inc(field)      atomic_fetch_add_explicit(&metrics->field, 1, memory_order_relaxed)
+#define metrics_set(field, v)   atomic_store_explicit(&metrics->field, v, memory_order_relaxed)
+
+static void metrics_unlink(void)
+{
+    shm_unlink(metrics_name);
+}
+
+/* move the counters into /dev/shm/<name> */
+static int metrics_open(const char *name)
+{
+    struct metrics *shm;
+    int fd;
+
+    snprintf(metrics_name, sizeof(metrics_name), "/%s", name);
+    fd = shm_open(metrics_name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0) {
+        err("shm_open %s failed: %s", metrics_name, strerror(errno));
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(*shm)) < 0) {
+        err("ftruncate %s failed: %s", metrics_name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        err("mmap %s failed: %s", metrics_name, strerror(errno));
+        return -1;
+    }
+
+    memset(shm, 0, sizeof(*shm));
+    shm->version = METRICS_VERSION;
+    shm->pid = getpid();
+    atomic_thread_fence(memory_order_release);
+    shm->magic = METRICS_MAGIC;
+    metrics = shm;
+    atexit(metrics_unlink);
+
+    return 0;
+}
+
+/* Prometheus text exposition of a running instance's counters */
+static int metrics_dump(const char *name)
+{
+    struct metrics *m;
+    char path[64];
+    uint64_t last_flip;
+    int fd;
+
+    snprintf(path, sizeof(path), "/%s", name);
+    fd = shm_open(path, O_RDONLY, 0);
+    if (fd < 0) {
+        fprintf(stderr, "no ffmpeg-drm metrics at %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    m = mmap(NULL, sizeof(*m), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED || m->magic != METRICS_MAGIC || m->version != METRICS_VERSION) {
+        fprintf(stderr, "invalid ffmpeg-drm metrics at %s\n", path);
+        return 1;
+    }
+
+#define METRIC(type, metric, value)                                             \
+        printf("# TYPE ffmpeg_drm_" metric " " type "\n"                        \
+               "ffmpeg_drm_" metric "{name=\"%s\",pid=\"%d\"} %llu\n",          \
+               name, m->pid, (unsigned long long) (value))
+
+    METRIC("counter", "frames_decoded_total", atomic_load(&m->frames_decoded));
+    METRIC("counter", "frames_presented_total", atomic_load(&m->frames_presented));
+    METRIC("counter", "missed_vblanks_total", atomic_load(&m->missed_vblanks));
+    METRIC("counter", "send_errors_total", atomic_load(&m->send_errors));
+    METRIC("counter", "decode_errors_total", atomic_load(&m->decode_errors));
+    METRIC("counter", "corrupt_frames_total", atomic_load(&m->corrupt_frames));
+    METRIC("counter", "read_errors_total", atomic_load(&m->read_errors));
+    METRIC("counter", "commit_errors_total", atomic_load(&m->commit_errors));
+    METRIC("counter", "resyncs_total", atomic_load(&m->resyncs));
+    METRIC("counter", "decoder_reopens_total", atomic_load(&m->decoder_reopens));
+    METRIC("counter", "preemptions_total", atomic_load(&m->preemptions));
+    METRIC("gauge", "bitrate_bps", atomic_load(&m->bitrate));
+    METRIC("gauge", "display_queue", atomic_load(&m->display_queue));
+    METRIC("gauge", "drm_buffers", atomic_load(&m->drm_buffers));
+    last_flip = atomic_load(&m->last_flip_us);
+    METRIC("gauge", "last_flip_us", last_flip);
+    printf("# TYPE ffmpeg_drm_last_flip_age_seconds gauge\n"
+           "ffmpeg_drm_last_flip_age_seconds{name=\"%s\",pid=\"%d\"} %.3f\n",
+           name, m->pid, last_flip ? (monotonic_us() - (int64_t) last_flip) / 1e6 : -1.0);
+#undef METRIC
+
+    munmap(m, sizeof(*m));
+    return 0;
+}
+
+static double drm_mode_refresh(const drmModeModeInfo * mode)
+{
+    if (!mode->htotal || !mode->vtotal)
+        return mode->vrefresh;
+
+    return mode->clock * 1000.0 / (mode->htotal * mode->vtotal);
+}
+
+/*
+ * A frame is expected to stay up for refresh / fps vblanks. The cadence
+ * is kept fractional, so 2:3 pulldown (23.976 or 25 fps at 60 Hz) is on
+ * time; a flip counts as missed only once it lands a whole vblank or more
+ * past its due time.
+ */
+static void metrics_flip(unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec)
+{
+    double refresh = pdev ? drm_mode_refresh(&pdev->mode) : share.vrefresh, expected = 1, late;
+    struct rusage usage;
+
+    /* with variable refresh every flip is its own vblank */
+    if (content_fps > 0 && refresh > content_fps && !modeset.vrr_active)
+        expected = refresh / content_fps;
+
+    if (last_flip_sequence) {
+        late = (double) (sequence - last_flip_sequence) - (expected + flip_phase);
+        if (late >= 1)
+            atomic_fetch_add_explicit(&metrics->missed_vblanks, (unsigned int) late, memory_order_relaxed);
+        /* keep the residual within a vblank, start over after a miss or an early flip */
+        flip_phase = late > -1 && late < 1 ? -late : 0;
+    }
+    last_flip_sequence = sequence;
+
+    metrics_set(last_flip_us, (uint64_t) tv_sec * 1000000 + tv_usec);
+    if (!getrusage(RUSAGE_THREAD, &usage))
+        metrics_set(preemptions, usage.ru_nivcsw);
+}
+
+static void metrics_packet(int size)
+{
+    int64_t now = monotonic_us();
+
+    if (!bitrate_window_start)
+        bitrate_window_start = now;
+
+    bitrate_window_bytes += size;
+    if (now - bitrate_window_start >= 1000000) {
+        metrics_set(bitrate, bitrate_window_bytes * 8 * 1000000 / (now - bitrate_window_start));
+        bitrate_window_start = now;
+        bitrate_window_bytes = 0;
+    }
+}
+
+#if _DEBUG_ALLOC_
+/*
+ * Counting allocator: malloc and friends are interposed, so what
+ * libavformat, libavcodec and libdrm allocate is seen as well. Only the
+ * playback thread counts, from the first flip on.
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t align, size_t size);
+
+static __thread int alloc_counting;
+static __thread uint64_t alloc_count;
+static uint64_t alloc_frames;   /* frames_presented when counting started */
+
+void *malloc(size_t size)
+{
+    alloc_count += alloc_counting;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    alloc_count += alloc_counting;
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    alloc_count += alloc_counting;
+    return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    alloc_count += alloc_counting;
+    return __libc_memalign(align, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size)
+{
+    alloc_count += alloc_counting;
+    *ptr = __libc_memalign(align, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+static void alloc_start(void)
+{
+    if (alloc_counting)
+        return;
+    alloc_frames = atomic_load(&metrics->frames_presented);
+    alloc_count = 0;
+    alloc_counting = 1;
+}
+
+static void alloc_report(void)
+{
+    uint64_t frames = atomic_load(&metrics->frames_presented) - alloc_frames;
+
+    if (!alloc_counting)
+        return;
+    alloc_counting = 0;
+    info("playback thread: %llu heap allocations over %llu frames (%.2f per frame)",
+         (unsigned long long) alloc_count, (unsigned long long) frames, frames ? (double) alloc_count / frames : 0.0);
+}
+#else
+#define alloc_start()   do { } while (0)
+#define alloc_report()  do { } while (0)
+#endif
+
+/* "0-3", "4,6,7" */
+static int rt_parse_cpus(const char *list, cpu_set_t *set)
+{
+    char *end;
+    long first, last, cpu;
+
+    CPU_ZERO(set);
+    while (*list) {
+        first = last = strtol(list, &end, 10);
+        if (end == list || first < 0)
+            return -1;
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first)
+                return -1;
+        }
+        for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, set);
+        if (*end != ',' && *end != '\0')
+            return -1;
+        list = *end ? end + 1 : end;
+    }
+
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+/* "fifo", "rr:70" */
+static int rt_parse_sched(const char *arg)
+{
+    const char *prio = strchr(arg, ':');
+    size_t len = prio ? (size_t) (prio - arg) : strlen(arg);
+
+    if (len == 4 && !strncmp(arg, "fifo", 4))
+        rt.policy = SCHED_FIFO;
+    else if (len == 2 && !strncmp(arg, "rr", 2))
+        rt.policy = SCHED_RR;
+    else if (len == 5 && !strncmp(arg, "other", 5))
+        rt.policy = SCHED_OTHER;
+    else
+        return -1;
+
+    rt.priority = prio ? atoi(prio + 1) : RT_DEFAULT_PRIORITY;
+    if (rt.policy != SCHED_OTHER &&
+        (rt.priority < sched_get_priority_min(rt.policy) || rt.priority > sched_get_priority_max(rt.policy)))
+        return -1;
+
+    return 0;
+}
+
+static int rt_set_policy(int policy, int priority)
+{
+    struct sched_param param = {.sched_priority = policy == SCHED_OTHER ? 0 : priority };
+
+    return pthread_setschedparam(pthread_self(), policy, &param);
+}
+
+/* called once from the playback thread before anything is opened */
+static void rt_apply_playback(void)
+{
+    int ret;
+
+    if (rt.has_playback) {
+        ret = pthread_setaffinity_np(pthread_self(), sizeof(rt.playback), &rt.playback);
+        if (ret)
+            err("playback CPU affinity: %s", strerror(ret));
+    }
+    if (rt.policy != SCHED_OTHER) {
+        ret = rt_set_policy(rt.policy, rt.priority);
+        if (ret)
+            err("%s priority %d: %s", rt.policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR",
+                rt.priority, strerror(ret));
+    }
+}
+
+/*
+ * Around avcodec_open2(): the decoder threads get the decoder CPUs and a
+ * normal policy, whichever thread opens the decoder.
+ */
+struct rt_saved {
+    cpu_set_t cpus;
+    int policy;
+    struct sched_param param;
+};
+
+static void rt_decoder_enter(struct rt_saved *saved)
+{
+    pthread_getaffinity_np(pthread_self(), sizeof(saved->cpus), &saved->cpus);
+    pthread_getschedparam(pthread_self(), &saved->policy, &saved->param);
+
+    if (rt.has_decoder)
+        pthread_setaffinity_np(pthread_self(), sizeof(rt.decoder), &rt.decoder);
+    if (saved->policy != SCHED_OTHER)
+        rt_set_policy(SCHED_OTHER, 0);
+}
+
+static void rt_decoder_leave(const struct rt_saved *saved)
+{
+    if (rt.has_decoder)
+        pthread_setaffinity_np(pthread_self(), sizeof(saved->cpus), &saved->cpus);
+    if (saved->policy != SCHED_OTHER)
+        pthread_setschedparam(pthread_self(), saved->policy, &saved->param);
+}
+
+/* background work never inherits the real-time policy of the playback thread */
+static int rt_thread_create(pthread_t * thread, void *(*fn)(void *), void *arg)
+{
+    struct sched_param param = {.sched_priority = 0 };
+    pthread_attr_t attr;
+    int ret;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+    if (rt.has_background)
+        pthread_attr_setaffinity_np(&attr, sizeof(rt.background), &rt.background);
+    ret = pthread_create(thread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+
+    return ret;
+}
+
+/*
+ * Once the first picture is up, everything the playback path touches
+ * exists: lock it. A mapped input file is left pageable.
+ */
+static void rt_lock_memory(void)
+{
+    int flags = MCL_CURRENT;
+
+    if (!rt.mlock || rt.locked)
+        return;
+    rt.locked = 1;
+
+    /* MCL_CURRENT alone would read a mapped input in whole: lock what is resident, then release the mapping */
+    if (active && active->mmap)
+        flags |= MCL_ONFAULT;
+
+    if (mlockall(flags)) {
+        err("mlockall: %s", strerror(errno));
+        return;
+    }
+    if (active && active->mmap)
+        munlock(active->mmap->data, active->mmap->map_size);
+}
+
+static void rt_report(void)
+{
+    struct rusage usage;
+
+    if (!rt.has_playback && rt.policy == SCHED_OTHER && !rt.mlock)
+        return;
+    if (getrusage(RUSAGE_THREAD, &usage))
+        return;
+
+    info("playback thread: %ld involuntary / %ld voluntary context switches, %llu missed vblanks",
+         usage.ru_nivcsw, usage.ru_nvcsw, (unsigned long long) atomic_load(&metrics->missed_vblanks));
+}
+
+/* hardware wrappers (rkmpp, v4l2m2m) do their own threading */
+static int profile_threads(const AVCodec *codec)
+{
+    long cpus;
+
+    if (codec->wrapper_name)
+        return 1;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? cpus : 1;
+}
+
+enum AVPixelFormat get_format(AVCodecContext * Context, const enum AVPixelFormat *PixFmt)
+{
+    const enum AVPixelFormat *p;
+    const AVPixFmtDescriptor *desc;
+
+    for (p = PixFmt; *p != AV_PIX_FMT_NONE; p++) {
+        if (*p == AV_PIX_FMT_DRM_PRIME)
+            return AV_PIX_FMT_DRM_PRIME;
+    }
+
+    /* no DRM PRIME: fall back to a software format, converted at display */
+    for (p = PixFmt; *p != AV_PIX_FMT_NONE; p++) {
+        desc = av_pix_fmt_desc_get(*p);
+        if (desc && !(desc->flags & AV_PIX_FMT_FLAG_HWACCEL))
+            return *p;
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+
+uint32_t get_property_id(const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < pdev->count_props; ++i)
+        if (!strcmp(pdev->props[i]->name, name))
+            return pdev->props[i]->prop_id;
+
+    return 0;
+}
+
+static void page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+    metrics_flip(sequence, tv_sec, tv_usec);
+}
+
+int drm_get_plane_props(int fd, uint32_t id)
+{
+    uint32_t i;
+
+    drmModeObjectPropertiesPtr props = drmModeObjectGetProperties(fd, id, DRM_MODE_OBJECT_PLANE);
+    if (!props) {
+        err("drmModeObjectGetProperties failed\n");
+        return -1;
+    }
+    //print("Found %u props\n", props->count_props);
+    pdev->count_props = props->count_props;
+    for (i = 0; i < props->count_props; i++) {
+        pdev->props[i] = drmModeGetProperty(fd, props->props[i]);
+        //print("Added prop %u:%s\n", pdev->props[i]->prop_id, pdev->props[i]->name);
+    }
+    drmModeFreeObjectProperties(props);
+
+    return 0;
+}
+
+int drm_add_property(const char *name, uint64_t value)
+{
+    int ret;
+    uint32_t prop_id = get_property_id(name);
+
+    if (!prop_id) {
+        err("Couldn't find prop %s\n", name);
+        return -1;
+    }
+
+    ret = drmModeAtomicAddProperty(pdev->req, pdev->plane_id, get_property_id(name), value);
+    if (ret < 0) {
+        err("drmModeAtomicAddProperty (%s:%lu) failed: %d\n", name, value, ret);
+        return ret;
+    }
+
+    return 0;
+}
+
+/* 32 bpp CPU-mapped buffer with a framebuffer: OSD, software frames, writeback */
+static int dumb_buffer_create(struct dumb_buffer *b, uint32_t width, uint32_t height, uint32_t fourcc)
+{
+    struct drm_mode_create_dumb creq;
+    struct drm_mode_map_dumb mreq;
+    uint32_t handles[4] = { 0 }, pitches[4] = { 0 }, offsets[4] = { 0 };
+    int ret;
+
+    /* create dumb buffer */
+    memset(&creq, 0, sizeof(creq));
+    creq.width = width;
+    creq.height = height;
+    creq.bpp = 32;
+    ret = drmIoctl(pdev->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
+    if (ret < 0) {
+        err("DRM_IOCTL_MODE_CREATE_DUMB fail\n");
+        return ret;
+    }
+    b->handle = creq.handle;
+    b->pitch = creq.pitch;
+    b->size = creq.size;
+
+    /* prepare buffer for memory mapping */
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.handle = creq.handle;
+    ret = drmIoctl(pdev->fd, DRM_IOCTL_MODE_MAP_DUMB, &mreq);
+    if (ret) {
+        err("DRM_IOCTL_MODE_MAP_DUMB fail\n");
+        return ret;
+    }
+
+    b->map = mmap(0, creq.size, PROT_READ | PROT_WRITE, MAP_SHARED, pdev->fd, mreq.offset);
+    if (b->map == MAP_FAILED) {
+        b->map = NULL;
+        err("mmap fail\n");
+        return -1;
+    }
+
+    /* clear the framebuffer to 0 (= black, or full transparency in ARGB8888) */
+    memset(b->map, 0, creq.size);
+    mem_add(&mem.dumb, &mem.dumb_peak, creq.size);
+
+    handles[0] = creq.handle;
+    pitches[0] = creq.pitch;
+    offsets[0] = 0;
+    /* create framebuffer object for the dumb-buffer */
+    ret = drmModeAddFB2(pdev->fd, width, height, fourcc, handles, pitches, offsets, &b->fb, 0);
+    if (ret) {
+        err("drmModeAddFB fail\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+static void dumb_buffer_destroy(struct dumb_buffer *b)
+{
+    struct drm_mode_destroy_dumb dreq;
+
+    if (b->fb)
+        drmModeRmFB(pdev->fd, b->fb);
+    if (b->map) {
+        munmap(b->map, b->size);
+        mem_add(&mem.dumb, &mem.dumb_peak, -(int64_t) b->size);
+    }
+    if (b->handle) {
+        memset(&dreq, 0, sizeof(dreq));
+        dreq.handle = b->handle;
+        drmIoctl(pdev->fd, DRM_IOCTL_MODE_DESTROY_DUMB, &dreq);
+    }
+    memset(b, 0, sizeof(*b));
+}
+
+/*
+ * OSD: subtitles and a status line on an ARGB8888 plane above the video.
+ * Two dumb buffers are used in turn; only damaged rectangles are redrawn
+ * in the back buffer (plus what the front buffer got last time), and the
+ * plane's FB_ID only goes into a commit when something changed.
+ */
+
+/* classic 5x7 font, printable ASCII, one byte per column, bit 0 on top */
+static const uint8_t osd_font[95][OSD_GLYPH_W] = {
+    {0x00, 0x00, 0x00, 0x00, 0x00}, {0x00, 0x00, 0x5f, 0x00, 0x00}, {0x00, 0x07, 0x00, 0x07, 0x00},
+    {0x14, 0x7f, 0x14, 0x7f, 0x14}, {0x24, 0x2a, 0x7f, 0x2a, 0x12}, {0x23, 0x13, 0x08, 0x64, 0x62},
+    {0x36, 0x49, 0x55, 0x22, 0x50}, {0x00, 0x05, 0x03, 0x00, 0x00}, {0x00, 0x1c, 0x22, 0x41, 0x00},
+    {0x00, 0x41, 0x22, 0x1c, 0x00}, {0x08, 0x2a, 0x1c, 0x2a, 0x08}, {0x08, 0x08, 0x3e, 0x08, 0x08},
+    {0x00, 0x50, 0x30, 0x00, 0x00}, {0x08, 0x08, 0x08, 0x08, 0x08}, {0x00, 0x60, 0x60, 0x00, 0x00},
+    {0x20, 0x10, 0x08, 0x04, 0x02}, {0x3e, 0x51, 0x49, 0x45, 0x3e}, {0x00, 0x42, 0x7f, 0x40, 0x00},
+    {0x42, 0x61, 0x51, 0x49, 0x46}, {0x21, 0x41, 0x45, 0x4b, 0x31}, {0x18, 0x14, 0x12, 0x7f, 0x10},
+    {0x27, 0x45, 0x45, 0x45, 0x39}, {0x3c, 0x4a, 0x49, 0x49, 0x30}, {0x01, 0x71, 0x09, 0x05, 0x03},
+    {0x36, 0x49, 0x49, 0x49, 0x36}, {0x06, 0x49, 0x49, 0x29, 0x1e}, {0x00, 0x36, 0x36, 0x00, 0x00},
+    {0x00, 0x56, 0x36, 0x00, 0x00}, {0x08, 0x14, 0x22, 0x41, 0x00}, {0x14, 0x14, 0x14, 0x14, 0x14},
+    {0x00, 0x41, 0x22, 0x14, 0x08}, {0x02, 0x01, 0x51, 0x09, 0x06}, {0x32, 0x49, 0x79, 0x41, 0x3e},
+    {0x7e, 0x11, 0x11, 0x11, 0x7e}, {0x7f, 0x49, 0x49, 0x49, 0x36}, {0x3e, 0x41, 0x41, 0x41, 0x22},
+    {0x7f, 0x41, 0x41, 0x22, 0x1c}, {0x7f, 0x49, 0x49, 0x49, 0x41}, {0x7f, 0x09, 0x09, 0x09, 0x01},
+    {0x3e, 0x41, 0x49, 0x49, 0x7a}, {0x7f, 0x08, 0x08, 0x08, 0x7f}, {0x00, 0x41, 0x7f, 0x41, 0x00},
+    {0x20, 0x40, 0x41, 0x3f, 0x01}, {0x7f, 0x08, 0x14, 0x22, 0x41}, {0x7f, 0x40, 0x40, 0x40, 0x40},
+    {0x7f, 0x02, 0x0c, 0x02, 0x7f}, {0x7f, 0x04, 0x08, 0x10, 0x7f}, {0x3e, 0x41, 0x41, 0x41, 0x3e},
+    {0x7f, 0x09, 0x09, 0x09, 0x06}, {0x3e, 0x41, 0x51, 0x21, 0x5e}, {0x7f, 0x09, 0x19, 0x29, 0x46},
+    {0x46, 0x49, 0x49, 0x49, 0x31}, {0x01, 0x01, 0x7f, 0x01, 0x01}, {0x3f, 0x40, 0x40, 0x40, 0x3f},
+    {0x1f, 0x20, 0x40, 0x20, 0x1f}, {0x3f, 0x40, 0x38, 0x40, 0x3f}, {0x63, 0x14, 0x08, 0x14, 0x63},
+    {0x07, 0x08, 0x70, 0x08, 0x07}, {0x61, 0x51, 0x49, 0x45, 0x43}, {0x00, 0x7f, 0x41, 0x41, 0x00},
+    {0x02, 0x04, 0x08, 0x10, 0x20}, {0x00, 0x41, 0x41, 0x7f, 0x00}, {0x04, 0x02, 0x01, 0x02, 0x04},
+    {0x40, 0x40, 0x40, 0x40, 0x40}, {0x00, 0x01, 0x02, 0x04, 0x00}, {0x20, 0x54, 0x54, 0x54, 0x78},
+    {0x7f, 0x48, 0x44, 0x44, 0x38}, {0x38, 0x44, 0x44, 0x44, 0x20}, {0x38, 0x44, 0x44, 0x48, 0x7f},
+    {0x38, 0x54, 0x54, 0x54, 0x18}, {0x08, 0x7e, 0x09, 0x01, 0x02}, {0x0c, 0x52, 0x52, 0x52, 0x3e},
+    {0x7f, 0x08, 0x04, 0x04, 0x78}, {0x00, 0x44, 0x7d, 0x40, 0x00}, {0x20, 0x40, 0x44, 0x3d, 0x00},
+    {0x7f, 0x10, 0x28, 0x44, 0x00}, {0x00, 0x41, 0x7f, 0x40, 0x00}, {0x7c, 0x04, 0x18, 0x04, 0x78},
+    {0x7c, 0x08, 0x04, 0x04, 0x78}, {0x38, 0x44, 0x44, 0x44, 0x38}, {0x7c, 0x14, 0x14, 0x14, 0x08},
+    {0x08, 0x14, 0x14, 0x18, 0x7c}, {0x7c, 0x08, 0x04, 0x04, 0x08}, {0x48, 0x54, 0x54, 0x54, 0x20},
+    {0x04, 0x3f, 0x44, 0x40, 0x20}, {0x3c, 0x40, 0x40, 0x20, 0x7c}, {0x1c, 0x20, 0x40, 0x20, 0x1c},
+    {0x3c, 0x40, 0x30, 0x40, 0x3c}, {0x44, 0x28, 0x10, 0x28, 0x44}, {0x0c, 0x50, 0x50, 0x50, 0x3c},
+    {0x44, 0x64, 0x54, 0x4c, 0x44}, {0x00, 0x08, 0x36, 0x41, 0x00}, {0x00, 0x00, 0x7f, 0x00, 0x00},
+    {0x00, 0x41, 0x36, 0x08, 0x00}, {0x08, 0x04, 0x08, 0x10, 0x08},
+};
+
+static int osd_rect_empty(const struct osd_rect *r)
+{
+    return r->w <= 0 || r->h <= 0;
+}
+
+static struct osd_rect osd_rect_intersect(struct osd_rect a, struct osd_rect b)
+{
+    struct osd_rect r;
+
+    r.x = FFMAX(a.x, b.x);
+    r.y = FFMAX(a.y, b.y);
+    r.w = FFMIN(a.x + a.w, b.x + b.w) - r.x;
+    r.h = FFMIN(a.y + a.h, b.y + b.h) - r.y;
+
+    return r;
+}
+
+static struct osd_rect osd_rect_union(struct osd_rect a, struct osd_rect b)
+{
+    struct osd_rect r;
+
+    if (osd_rect_empty(&a))
+        return b;
+    if (osd_rect_empty(&b))
+        return a;
+
+    r.x = FFMIN(a.x, b.x);
+    r.y = FFMIN(a.y, b.y);
+    r.w = FFMAX(a.x + a.w, b.x + b.w) - r.x;
+    r.h = FFMAX(a.y + a.h, b.y + b.h) - r.y;
+
+    return r;
+}
+
+/* add to a damage list, collapsing it into its bounding box when full */
+static void osd_damage_add(struct osd_rect *list, int *count, struct osd_rect r)
+{
+    struct osd_rect screen = { 0, 0, osd.width, osd.height };
+    int i;
+
+    r = osd_rect_intersect(r, screen);
+    if (osd_rect_empty(&r))
+        return;
+
+    if (*count == OSD_MAX_DAMAGE) {
+        for (i = 1; i < *count; i++)
+            list[0] = osd_rect_union(list[0], list[i]);
+        *count = 1;
+    }
+    list[(*count)++] = r;
+}
+
+static int osd_init(int plane_id)
+{
+    int i;
+
+    osd.plane_id = plane_id;
+    osd.width = pdev->width;
+    osd.height = pdev->height;
+    osd.scale = FFMAX(1, osd.height / 270);
+
+    for (i = 0; i < 2; i++) {
+        if (dumb_buffer_create(&osd.bufs[i], osd.width, osd.height, DRM_FORMAT_ARGB8888)) {
+            dumb_buffer_destroy(&osd.bufs[0]);
+            dumb_buffer_destroy(&osd.bufs[1]);
+            osd.plane_id = 0;
+            return -1;
+        }
+    }
+
+    /* the first commit puts the cleared buffer on the plane */
+    osd.front = 1;
+    osd.fb_pending = 1;
+    osd.setup = 1;
+
+    dbg("OSD plane %u: %ux%u, 2 x %llu bytes", plane_id, osd.width, osd.height,
+        (unsigned long long) osd.bufs[0].size);
+
+    return 0;
+}
+
+static void osd_free(void)
+{
+    if (!osd.plane_id)
+        return;
+
+    if (osd.sub.valid)
+        avsubtitle_free(&osd.sub.sub);
+    dumb_buffer_destroy(&osd.bufs[0]);
+    dumb_buffer_destroy(&osd.bufs[1]);
+    osd.plane_id = 0;
+}
+
+/* lay out lines of text in a box: centered at the bottom, or at the top left */
+static void osd_text_layout(struct osd_text *t, int bottom)
+{
+    int i, len, w = 0, margin = 2 * t->scale;
+
+    for (i = 0; i < t->nb_lines; i++) {
+        len = strlen(t->lines[i]);
+        w = FFMAX(w, len * (OSD_GLYPH_W + 1) * t->scale);
+    }
+
+    t->box.w = w + 2 * margin;
+    t->box.h = t->nb_lines * (OSD_GLYPH_H + 2) * t->scale + 2 * margin;
+    if (bottom) {
+        t->box.x = (osd.width - t->box.w) / 2;
+        t->box.y = osd.height - t->box.h - osd.height / 20;
+    } else {
+        t->box.x = osd.width / 40;
+        t->box.y = osd.height / 40;
+    }
+    if (!w)
+        t->box.w = t->box.h = 0;
+}
+
+/* text split into lines at newlines; ASS also has {} override tags and \N breaks */
+static void osd_text_parse(struct osd_text *t, const char *p, int ass)
+{
+    int n = 0;
+
+    t->nb_lines = 1;
+    t->lines[0][0] = '\0';
+    for (; *p && t->nb_lines <= OSD_MAX_LINES; p++) {
+        if (ass && *p == '{') {
+            while (*p && *p != '}')
+                p++;
+            if (!*p)
+                break;
+        } else if ((ass && p[0] == '\\' && (p[1] == 'N' || p[1] == 'n')) || *p == '\n') {
+            if (*p == '\\')
+                p++;
+            if (t->nb_lines == OSD_MAX_LINES)
+                break;
+            t->lines[t->nb_lines++][0] = '\0';
+            n = 0;
+        } else if (*p != '\r' && n < OSD_MAX_CHARS) {
+            t->lines[t->nb_lines - 1][n++] = *p;
+            t->lines[t->nb_lines - 1][n] = '\0';
+        }
+    }
+}
+
+/* ASS dialogue from libavcodec: 8 fields before the text */
+static void osd_text_from_ass(struct osd_text *t, const char *ass)
+{
+    const char *p = ass;
+    int i;
+
+    for (i = 0; i < 8 && p; i++) {
+        p = strchr(p, ',');
+        if (p)
+            p++;
+    }
+    osd_text_parse(t, p ? p : ass, 1);
+}
+
+static void osd_draw_text(uint32_t *map, int stride, const struct osd_text *t, struct osd_rect clip)
+{
+    int x, y, line, col, row, c, gx;
+    int cell_w = (OSD_GLYPH_W + 1) * t->scale, cell_h = (OSD_GLYPH_H + 2) * t->scale;
+    int margin = 2 * t->scale;
+
+    clip = osd_rect_intersect(clip, t->box);
+    for (y = clip.y; y < clip.y + clip.h; y++) {
+        uint32_t *dst = map + y * stride;
+
+        line = (y - t->box.y - margin) / cell_h;
+        row = ((y - t->box.y - margin) % cell_h) / t->scale;
+        for (x = clip.x; x < clip.x + clip.w; x++) {
+            dst[x] = OSD_BACKGROUND;
+            if (y < t->box.y + margin || x < t->box.x + margin || line >= t->nb_lines || row >= OSD_GLYPH_H)
+                continue;
+            gx = x - t->box.x - margin;
+            col = (gx % cell_w) / t->scale;
+            if (col >= OSD_GLYPH_W || gx / cell_w >= (int) strlen(t->lines[line]))
+                continue;
+            c = (unsigned char) t->lines[line][gx / cell_w];
+            if (c < 0x20 || c > 0x7e)
+                c = '?';
+            if (osd_font[c - 0x20][col] & (1 << row))
+                dst[x] = OSD_FOREGROUND;
+        }
+    }
+}
+
+static struct osd_rect osd_sub_rect(const AVSubtitleRect *r)
+{
+    struct osd_rect box;
+
+    box.x = (int64_t) r->x * osd.width / osd.sub.canvas_w;
+    box.y = (int64_t) r->y * osd.height / osd.sub.canvas_h;
+    box.w = (int64_t) r->w * osd.width / osd.sub.canvas_w;
+    box.h = (int64_t) r->h * osd.height / osd.sub.canvas_h;
+
+    return box;
+}
+
+/* palettized bitmap subtitles, scaled from the subtitle canvas to the screen */
+static void osd_draw_bitmap(uint32_t *map, int stride, const AVSubtitleRect *r, struct osd_rect clip)
+{
+    struct osd_rect box = osd_sub_rect(r);
+    const uint32_t *palette = (const uint32_t *) r->data[1];
+    int x, y, sx, sy;
+
+    clip = osd_rect_intersect(clip, box);
+    for (y = clip.y; y < clip.y + clip.h; y++) {
+        sy = (int64_t) (y - box.y) * r->h / box.h;
+        for (x = clip.x; x < clip.x + clip.w; x++) {
+            sx = (int64_t) (x - box.x) * r->w / box.w;
+            map[y * stride + x] = palette[r->data[0][sy * r->linesize[0] + sx]];
+        }
+    }
+}
+
+/* redraw one rectangle of a buffer from the current OSD content */
+static void osd_redraw(struct dumb_buffer *b, struct osd_rect clip)
+{
+    uint32_t *map = b->map;
+    int stride = b->pitch / 4;
+    unsigned int i;
+    int y;
+
+    for (y = clip.y; y < clip.y + clip.h; y++)
+        memset(map + y * stride + clip.x, 0, clip.w * 4);
+
+    if (osd.sub.shown) {
+        if (osd.sub.text.nb_lines)
+            osd_draw_text(map, stride, &osd.sub.text, clip);
+        else
+            for (i = 0; i < osd.sub.sub.num_rects; i++)
+                if (osd.sub.sub.rects[i]->type == SUBTITLE_BITMAP)
+                    osd_draw_bitmap(map, stride, osd.sub.sub.rects[i], clip);
+    }
+
+    if (osd.status_enabled)
+        osd_draw_text(map, stride, &osd.status, clip);
+}
+
+/*
+ * After a flip the back buffer missed what went into the front one last
+ * time: redraw that too. Each update becomes the other buffer's debt; it
+ * accumulates until the back buffer is committed, so an update whose
+ * commit failed is still owed.
+ */
+static void osd_render(void)
+{
+    struct dumb_buffer *back = &osd.bufs[!osd.front];
+    int i;
+
+    if (!osd.fb_pending) {
+        for (i = 0; i < osd.nb_prev; i++)
+            osd_redraw(back, osd.prev[i]);
+        osd.nb_prev = 0;
+    }
+    for (i = 0; i < osd.nb_damage; i++) {
+        osd_redraw(back, osd.damage[i]);
+        osd_damage_add(osd.prev, &osd.nb_prev, osd.damage[i]);
+    }
+
+    osd.nb_damage = 0;
+    osd.fb_pending = 1;
+}
+
+/* take ownership of a decoded subtitle, shown once the video reaches its start */
+static void osd_set_subtitle(AVSubtitle *sub, int canvas_w, int canvas_h)
+{
+    unsigned int i;
+
+    if (!osd.plane_id) {
+        avsubtitle_free(sub);
+        return;
+    }
+
+    if (osd.sub.valid) {
+        if (osd.sub.shown)
+            osd_damage_add(osd.damage, &osd.nb_damage, osd.sub.box);
+        avsubtitle_free(&osd.sub.sub);
+    }
+
+    memset(&osd.sub, 0, sizeof(osd.sub));
+    osd.sub.sub = *sub;
+    osd.sub.valid = 1;
+    osd.sub.canvas_w = canvas_w > 0 ? canvas_w : osd.width;
+    osd.sub.canvas_h = canvas_h > 0 ? canvas_h : osd.height;
+    osd.sub.start = sub->pts + (int64_t) sub->start_display_time * 1000;
+    osd.sub.end = (sub->end_display_time && sub->end_display_time != UINT32_MAX) ?
+        sub->pts + (int64_t) sub->end_display_time * 1000 : INT64_MAX;
+
+    osd.sub.text.scale = osd.scale;
+    for (i = 0; i < sub->num_rects; i++) {
+        AVSubtitleRect *r = sub->rects[i];
+
+        if (r->type == SUBTITLE_BITMAP)
+            osd.sub.box = osd_rect_union(osd.sub.box, osd_sub_rect(r));
+        else if (r->type == SUBTITLE_ASS && r->ass && !osd.sub.text.nb_lines)
+            osd_text_from_ass(&osd.sub.text, r->ass);
+        else if (r->type == SUBTITLE_TEXT && r->text && !osd.sub.text.nb_lines)
+            osd_text_parse(&osd.sub.text, r->text, 0);     /* as is: commas and braces are text */
+    }
+    if (osd.sub.text.nb_lines) {
+        osd_text_layout(&osd.sub.text, 1);
+        osd.sub.box = osd.sub.text.box;
+    }
+}
+
+/* advance the OSD content to the picture at pts, recording what changed */
+static void osd_update(int64_t pts)
+{
+    struct osd_text status;
+    int64_t s;
+
+    if (!osd.plane_id)
+        return;
+
+    if (osd.sub.valid && !osd.sub.shown && pts >= osd.sub.start && pts < osd.sub.end) {
+        osd.sub.shown = 1;
+        osd_damage_add(osd.damage, &osd.nb_damage, osd.sub.box);
+    } else if (osd.sub.shown && pts >= osd.sub.end) {
+        osd.sub.shown = 0;
+        osd_damage_add(osd.damage, &osd.nb_damage, osd.sub.box);
+    }
+
+    if (osd.status_enabled) {
+        memset(&status, 0, sizeof(status));
+        s = pts > 0 ? pts / AV_TIME_BASE : 0;
+        snprintf(status.lines[0], sizeof(status.lines[0]), "%02d:%02d:%02d %dx%s",
+                 (int) (s / 3600), (int) (s / 60 % 60), (int) (s % 60), trick.rate, paused ? " PAUSED" : "");
+        status.nb_lines = 1;
+        status.scale = osd.scale;
+        osd_text_layout(&status, 0);
+        if (strcmp(status.lines[0], osd.status.lines[0])) {
+            osd_damage_add(osd.damage, &osd.nb_damage, osd_rect_union(osd.status.box, status.box));
+            osd.status = status;
+        }
+    }
+
+    if (osd.nb_damage)
+        osd_render();
+}
+
+/* put the new OSD buffer in the pending atomic request */
+static void osd_add_props(void)
+{
+    uint32_t id = osd.plane_id;
+
+    if (!id || !osd.fb_pending)
+        return;
+
+    drmModeAtomicAddProperty(pdev->req, id, get_property_id("FB_ID"), osd.bufs[!osd.front].fb);
+    if (!osd.setup)
+        return;
+
+    drmModeAtomicAddProperty(pdev->req, id, get_property_id("CRTC_ID"), pdev->crtc_id);
+    drmModeAtomicAddProperty(pdev->req, id, get_property_id("SRC_X"), 0);
+    drmModeAtomicAddProperty(pdev->req, id, get_property_id("SRC_Y"), 0);
+    drmModeAtomicAddProperty(pdev->req, id, get_property_id("SRC_W"), osd.width << 16);
+    drmModeAtomicAddProperty(pdev->req, id, get_property_id("SRC_H"), osd.height << 16);
+    drmModeAtomicAddProperty(pdev->req, id, get_property_id("CRTC_X"), 0);
+    drmModeAtomicAddProperty(pdev->req, id, get_property_id("CRTC_Y"), 0);
+    drmModeAtomicAddProperty(pdev->req, id, get_property_id("CRTC_W"), osd.width);
+    drmModeAtomicAddProperty(pdev->req, id, get_property_id("CRTC_H"), osd.height);
+}
+
+static void osd_committed(void)
+{
+    if (!osd.plane_id || !osd.fb_pending)
+        return;
+
+    osd.front = !osd.front;
+    osd.fb_pending = 0;
+    osd.setup = 0;
+}
+
+/* OSD-only commit, for changes while no video frame is being flipped */
+static void osd_commit(void)
+{
+    if (!osd.plane_id || !osd.fb_pending || !pdev)
+        return;
+
+    osd_add_props();
+    if (drmModeAtomicCommit(pdev->fd, pdev->req, 0, NULL))
+        err("OSD commit failed: %s\n", strerror(errno));
+    else
+        osd_committed();
+    drmModeAtomicSetCursor(pdev->req, 0);
+}
+
+/* property id of a KMS object, and its current value; 0 when missing */
+static uint32_t drm_object_prop(int fd, uint32_t id, uint32_t type, const char *name, uint64_t *value)
+{
+    drmModeObjectPropertiesPtr props;
+    drmModePropertyPtr prop;
+    uint32_t i, prop_id = 0;
+
+    props = drmModeObjectGetProperties(fd, id, type);
+    if (!props)
+        return 0;
+
+    for (i = 0; i < props->count_props && !prop_id; i++) {
+        prop = drmModeGetProperty(fd, props->props[i]);
+        if (!prop)
+            continue;
+        if (!strcmp(prop->name, name)) {
+            prop_id = prop->prop_id;
+            if (value)
+                *value = props->prop_values[i];
+        }
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+
+    return prop_id;
+}
+
+/*
+ * Lower is better. With rate matching: judder first (distance to a whole
+ * number of refreshes per frame), then refreshes per frame, so 23.976 fps
+ * takes 23.976 Hz over 24 Hz, 47.952 Hz or 60 Hz. Otherwise: the refresh
+ * closest to the preferred mode.
+ */
+static double drm_mode_score(const drmModeModeInfo * mode)
+{
+    double refresh = drm_mode_refresh(mode), ratio;
+
+    if (!modeset.match_rate || content_fps <= 0)
+        return fabs(refresh - drm_mode_refresh(&pdev->mode));
+
+    ratio = refresh / content_fps;
+    if (ratio < 0.99)
+        return 1000 + 1 / ratio;
+
+    return 100 * fabs(ratio - floor(ratio + 0.5)) + ratio;
+}
+
+/* choose the connector mode for the content and prepare VRR */
+static int drm_modeset_init(int fd)
+{
+    drmModeConnector *conn;
+    drmModeModeInfo *mode, *best = NULL;
+    unsigned int width = modeset.width ? modeset.width : pdev->mode.hdisplay;
+    unsigned int height = modeset.height ? modeset.height : pdev->mode.vdisplay;
+    uint64_t capable = 0;
+    double score, best_score = 0;
+    int i;
+
+    conn = drmModeGetConnector(fd, pdev->conn_id);
+    if (!conn) {
+        err("drmModeGetConnector() failed");
+        return -1;
+    }
+
+    for (i = 0; i < conn->count_modes; i++) {
+        mode = &conn->modes[i];
+        if ((mode->flags & DRM_MODE_FLAG_INTERLACE) || mode->hdisplay != width || mode->vdisplay != height)
+            continue;
+        score = drm_mode_score(mode);
+        if (!best || score < best_score) {
+            best = mode;
+            best_score = score;
+        }
+    }
+
+    if (!best) {
+        err("no %ux%u mode on connector %u", width, height, pdev->conn_id);
+        drmModeFreeConnector(conn);
+        return -1;
+    }
+
+    modeset.prop_mode_id = drm_object_prop(fd, pdev->crtc_id, DRM_MODE_OBJECT_CRTC, "MODE_ID", NULL);
+    modeset.prop_active = drm_object_prop(fd, pdev->crtc_id, DRM_MODE_OBJECT_CRTC, "ACTIVE", NULL);
+    modeset.prop_conn_crtc = drm_object_prop(fd, pdev->conn_id, DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID", NULL);
+
+    if (memcmp(best, &pdev->mode, sizeof(*best)) && modeset.prop_mode_id) {
+        if (drmModeCreatePropertyBlob(fd, best, sizeof(*best), &modeset.mode_blob)) {
+            err("cannot create mode blob: %s", strerror(errno));
+            drmModeFreeConnector(conn);
+            return -1;
+        }
+        memcpy(&pdev->mode, best, sizeof(*best));
+        pdev->width = best->hdisplay;
+        pdev->height = best->vdisplay;
+        modeset.pending = 1;
+    }
+    info("mode %s %.3f Hz for %.3f fps content", pdev->mode.name, drm_mode_refresh(&pdev->mode), content_fps);
+    drmModeFreeConnector(conn);
+
+    /* variable refresh: the connector must be capable, the CRTC have the property */
+    if (modeset.vrr) {
+        drm_object_prop(fd, pdev->conn_id, DRM_MODE_OBJECT_CONNECTOR, "vrr_capable", &capable);
+        modeset.prop_vrr = drm_object_prop(fd, pdev->crtc_id, DRM_MODE_OBJECT_CRTC, "VRR_ENABLED", NULL);
+        if (capable && modeset.prop_vrr) {
+            modeset.vrr_active = 1;
+            modeset.pending = 1;
+        } else {
+            err("VRR not supported on connector %u / CRTC %u", pdev->conn_id, pdev->crtc_id);
+        }
+    }
+
+    /* refresh and frame rate may differ: show each picture at its time */
+    modeset.pace = 1;
+
+    return 0;
+}
+
+/* the mode and VRR go in the first commit, which allows a modeset */
+static void drm_modeset_add_props(void)
+{
+    if (!modeset.pending)
+        return;
+
+    if (modeset.mode_blob) {
+        drmModeAtomicAddProperty(pdev->req, pdev->crtc_id, modeset.prop_mode_id, modeset.mode_blob);
+        if (modeset.prop_active)
+            drmModeAtomicAddProperty(pdev->req, pdev->crtc_id, modeset.prop_active, 1);
+        if (modeset.prop_conn_crtc)
+            drmModeAtomicAddProperty(pdev->req, pdev->conn_id, modeset.prop_conn_crtc, pdev->crtc_id);
+    }
+    if (modeset.vrr_active)
+        drmModeAtomicAddProperty(pdev->req, pdev->crtc_id, modeset.prop_vrr, 1);
+}
+
+static void drm_modeset_committed(void)
+{
+    if (!modeset.pending)
+        return;
+
+    /* the CRTC state holds its own reference */
+    if (modeset.mode_blob)
+        drmModeDestroyPropertyBlob(pdev->fd, modeset.mode_blob);
+    modeset.mode_blob = 0;
+    modeset.pending = 0;
+
+    /* a modeset can block for hundreds of ms: restart the media clock from the next picture */
+    trick.anchored = 0;
+}
+
+/* find the writeback connector of our CRTC and allocate its capture buffers */
+static int wb_init(int fd)
+{
+    drmModeRes *res;
+    drmModeConnector *conn;
+    drmModeEncoder *enc;
+    drmModeObjectPropertiesPtr props;
+    drmModePropertyPtr prop;
+    drmModePropertyBlobPtr blob;
+    const uint32_t *formats;
+    int i, j, xrgb = 0;
+
+    res = drmModeGetResources(fd);
+    if (!res) {
+        err("drmModeGetResources() failed");
+        return -1;
+    }
+    for (i = 0; i < res->count_connectors && !wb.conn_id; i++) {
+        conn = drmModeGetConnector(fd, res->connectors[i]);
+        if (!conn)
+            continue;
+        if (conn->connector_type == DRM_MODE_CONNECTOR_WRITEBACK) {
+            for (j = 0; j < conn->count_encoders && !wb.conn_id; j++) {
+                enc = drmModeGetEncoder(fd, conn->encoders[j]);
+                if (enc && (enc->possible_crtcs & (1 << pdev->crtc_idx)))
+                    wb.conn_id = conn->connector_id;
+                drmModeFreeEncoder(enc);
+            }
+        }
+        drmModeFreeConnector(conn);
+    }
+    drmModeFreeResources(res);
+
+    if (!wb.conn_id) {
+        err("no writeback connector for CRTC %u", pdev->crtc_id);
+        return -1;
+    }
+
+    props = drmModeObjectGetProperties(fd, wb.conn_id, DRM_MODE_OBJECT_CONNECTOR);
+    if (!props) {
+        err("drmModeObjectGetProperties failed\n");
+        return -1;
+    }
+    for (i = 0; i < props->count_props; i++) {
+        prop = drmModeGetProperty(fd, props->props[i]);
+        if (!prop)
+            continue;
+        if (!strcmp(prop->name, "CRTC_ID"))
+            wb.prop_crtc = prop->prop_id;
+        else if (!strcmp(prop->name, "WRITEBACK_FB_ID"))
+            wb.prop_fb = prop->prop_id;
+        else if (!strcmp(prop->name, "WRITEBACK_OUT_FENCE_PTR"))
+            wb.prop_fence = prop->prop_id;
+        else if (!strcmp(prop->name, "WRITEBACK_PIXEL_FORMATS")) {
+            blob = drmModeGetPropertyBlob(fd, props->prop_values[i]);
+            if (blob) {
+                formats = blob->data;
+                for (j = 0; j < blob->length / sizeof(*formats); j++)
+                    xrgb |= formats[j] == DRM_FORMAT_XRGB8888;
+                drmModeFreePropertyBlob(blob);
+            }
+        }
+        drmModeFreeProperty(prop);
+    }
+    drmModeFreeObjectProperties(props);
+
+    if (!wb.prop_crtc || !wb.prop_fb || !xrgb) {
+        err("writeback connector %u: no XRGB8888 capture", wb.conn_id);
+        wb.conn_id = 0;
+        return -1;
+    }
+
+    for (i = 0; i < WB_BUFFERS; i++) {
+        if (dumb_buffer_create(&wb.bufs[i], pdev->width, pdev->height, DRM_FORMAT_XRGB8888)) {
+            for (j = 0; j <= i; j++)
+                dumb_buffer_destroy(&wb.bufs[j]);
+            wb.conn_id = 0;
+            return -1;
+        }
+    }
+    wb.dump_row = malloc(pdev->width * 3);
+    if (!wb.dump_row) {
+        for (i = 0; i < WB_BUFFERS; i++)
+            dumb_buffer_destroy(&wb.bufs[i]);
+        wb.conn_id = 0;
+        return AVERROR(ENOMEM);
+    }
+    wb.setup = 1;
+
+    dbg("writeback connector %u: %ux%u, %d buffers", wb.conn_id, pdev->width, pdev->height, WB_BUFFERS);
+
+    return 0;
+}
+
+/* hash file and golden file, opened before playback */
+static int wb_open(void)
+{
+    FILE *f;
+    char line[128];
+    unsigned int n, crc, size = 0;
+    uint32_t *golden;
+
+    if (wb.hash_file) {
+        wb.hashes = strcmp(wb.hash_file, "-") ? fopen(wb.hash_file, "w") : stdout;
+        if (!wb.hashes) {
+            err("cannot open %s: %s", wb.hash_file, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (!wb.golden_file)
+        return 0;
+
+    f = fopen(wb.golden_file, "r");
+    if (!f) {
+        err("cannot open %s: %s", wb.golden_file, strerror(errno));
+        return -1;
+    }
+    /* same format as the hash file: <frame> <pts> <crc32> */
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%u %*s %x", &n, &crc) != 2)
+            continue;
+        if (n >= size) {
+            golden = realloc(wb.golden, FFMAX(n + 1, 2 * size) * sizeof(*golden));
+            if (!golden) {
+                fclose(f);
+                return AVERROR(ENOMEM);
+            }
+            memset(golden + size, 0, (FFMAX(n + 1, 2 * size) - size) * sizeof(*golden));
+            size = FFMAX(n + 1, 2 * size);
+            wb.golden = golden;
+        }
+        wb.golden[n] = crc;
+        wb.nb_golden = FFMAX(wb.nb_golden, n + 1);
+    }
+    fclose(f);
+
+    if (!wb.nb_golden) {
+        err("no hashes in %s", wb.golden_file);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* --dump-frames list: "0,25,100-200,500-" */
+static int wb_dump_selected(unsigned int n)
+{
+    const char *p = wb.dump_frames;
+    char *end;
+    unsigned long first, last;
+
+    if (!p)
+        return 1;
+
+    while (*p) {
+        first = last = strtoul(p, &end, 10);
+        if (end == p)
+            return 0;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtoul(p, &end, 10);
+            if (end == p)
+                last = (unsigned long) -1;
+        }
+        if (n >= first && n <= last)
+            return 1;
+        if (*end != ',')
+            return 0;
+        p = end + 1;
+    }
+
+    return 0;
+}
+
+static void wb_dump(const struct dumb_buffer *b, unsigned int n)
+{
+    char path[PATH_MAX];
+    const uint8_t *src;
+    uint32_t x, y;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/frame-%06u.ppm", wb.dump_dir, n);
+    f = fopen(path, "w");
+    if (!f) {
+        err("cannot open %s: %s", path, strerror(errno));
+        return;
+    }
+
+    /* XRGB8888 is B, G, R, X in memory */
+    fprintf(f, "P6\n%u %u\n255\n", pdev->width, pdev->height);
+    for (y = 0; y < pdev->height; y++) {
+        src = (const uint8_t *) b->map + (size_t) y * b->pitch;
+        for (x = 0; x < pdev->width; x++) {
+            wb.dump_row[3 * x + 0] = src[4 * x + 2];
+            wb.dump_row[3 * x + 1] = src[4 * x + 1];
+            wb.dump_row[3 * x + 2] = src[4 * x + 0];
+        }
+        fwrite(wb.dump_row, 3, pdev->width, f);
+    }
+    fclose(f);
+}
+
+/* capture the next frame into the free writeback buffer */
+static void wb_add_props(void)
+{
+    if (!wb.conn_id)
+        return;
+
+    if (wb.setup)
+        drmModeAtomicAddProperty(pdev->req, wb.conn_id, wb.prop_crtc, pdev->crtc_id);
+    drmModeAtomicAddProperty(pdev->req, wb.conn_id, wb.prop_fb, wb.bufs[wb.next].fb);
+    wb.fence = -1;
+    if (wb.prop_fence)
+        drmModeAtomicAddProperty(pdev->req, wb.conn_id, wb.prop_fence, (uint64_t) (uintptr_t) & wb.fence);
+    wb.queued = 1;
+}
+
+/* after the flip: wait for the writeback job, then hash, check and dump */
+static void wb_capture(int64_t pts)
+{
+    const AVCRC *table = av_crc_get_table(AV_CRC_32_IEEE_LE);
+    struct dumb_buffer *b = &wb.bufs[wb.next];
+    struct pollfd pfd;
+    uint32_t crc = 0, y;
+
+    if (!wb.queued)
+        return;
+    wb.queued = 0;
+    wb.setup = 0;
+
+    if (wb.fence >= 0) {
+        pfd.fd = wb.fence;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, WB_FENCE_TIMEOUT) <= 0)
+            err("writeback: frame %u not signaled", wb.frame);
+        close(wb.fence);
+        wb.fence = -1;
+    }
+
+    /* visible pixels only, the pitch padding is undefined */
+    for (y = 0; y < pdev->height; y++)
+        crc = av_crc(table, crc, (const uint8_t *) b->map + (size_t) y * b->pitch, pdev->width * 4);
+
+    if (wb.hashes)
+        fprintf(wb.hashes, "%u %lld %08x\n", wb.frame, (long long) pts, crc);
+    if (wb.golden && (wb.frame >= wb.nb_golden || wb.golden[wb.frame] != crc)) {
+        err("writeback: frame %u crc %08x, golden %08x", wb.frame, crc,
+            wb.frame < wb.nb_golden ? wb.golden[wb.frame] : 0);
+        wb.mismatches++;
+    }
+    if (wb.dump_dir && wb_dump_selected(wb.frame))
+        wb_dump(b, wb.frame);
+
+    wb.frame++;
+    wb.next = (wb.next + 1) % WB_BUFFERS;
+}
+
+/* release the capture, returns non zero when the golden check failed */
+static int wb_finish(void)
+{
+    int i;
+
+    if (!wb.enabled)
+        return 0;
+
+    if (wb.golden && wb.frame < wb.nb_golden) {
+        err("writeback: %u frames captured, golden file has %u", wb.frame, wb.nb_golden);
+        wb.mismatches += wb.nb_golden - wb.frame;
+    }
+    info("writeback: %u frames captured%s, %u mismatches", wb.frame,
+         wb.golden ? " and checked" : "", wb.mismatches);
+
+    if (wb.hashes && wb.hashes != stdout)
+        fclose(wb.hashes);
+    for (i = 0; i < WB_BUFFERS && pdev; i++)
+        dumb_buffer_destroy(&wb.bufs[i]);
+    free(wb.golden);
+    free(wb.dump_row);
+
+    return wb.mismatches != 0;
+}
+
+/* largest rectangle with the picture's aspect ratio, centred in area_w x area_h */
+static void fit_rect(uint32_t width, uint32_t height, AVRational sar, uint32_t area_w, uint32_t area_h,
+                     uint32_t * x, uint32_t * y, uint32_t * w, uint32_t * h)
+{
+    uint32_t crtc_w;
+    uint32_t crtc_h;
+    uint32_t crtc_x = 0;
+    uint32_t crtc_y = 0;
+    double ratio_w;
+    double ratio_h;
+
+    if (!sar.num || !sar.den) {
+        sar.num = 1;
+        sar.den = 1;
+    }
+
+    crtc_w = (width * sar.num) / sar.den;
+    crtc_h = height;
+    ratio_w = (double) area_w / crtc_w;
+    ratio_h = (double) area_h / crtc_h;
+
+    if (ratio_w > ratio_h) {
+        crtc_w *= ratio_h;
+        crtc_h *= ratio_h;
+        crtc_x = (area_w - crtc_w) / 2;
+    } else {
+        crtc_w *= ratio_w;
+        crtc_h *= ratio_w;
+        crtc_y = (area_h - crtc_h) / 2;
+    }
+
+    *x = crtc_x;
+    *y = crtc_y;
+    *w = crtc_w;
+    *h = crtc_h;
+}
+
+int drm_dmabuf_set_plane(struct drm_buffer *buf, uint32_t width, uint32_t height, int fullscreen, AVRational sar)
+{
+    int ret;
+    int64_t t;
+    uint32_t crtc_w;
+    uint32_t crtc_h;
+    uint32_t crtc_x;
+    uint32_t crtc_y;
+
+    fd_set fds;
+    FD_ZERO(&fds);
+    FD_SET(pdev->fd, &fds);
+
+    fit_rect(width, height, sar, pdev->width, pdev->height, &crtc_x, &crtc_y, &crtc_w, &crtc_h);
+
+    // print("crtc_x: %u; crtc_y:%u; crtc_w: %u; crtc_h: %u\n", crtc_x, crtc_y, crtc_w, crtc_h);
+
+    drm_add_property("FB_ID", buf->fb_handle);
+    drm_add_property("CRTC_ID", pdev->crtc_id);
+    drm_add_property("SRC_X", 0);
+    drm_add_property("SRC_Y", 0);
+    drm_add_property("SRC_W", width << 16);
+    drm_add_property("SRC_H", height << 16);
+    drm_add_property("CRTC_X", crtc_x);
+    drm_add_property("CRTC_Y", crtc_y);
+    drm_add_property("CRTC_W", crtc_w);
+    drm_add_property("CRTC_H", crtc_h);
+
+    osd_add_props();
+    wb_add_props();
+    drm_modeset_add_props();
+
+    t = trace_begin();
+    ret = drmModeAtomicCommit(pdev->fd, pdev->req, DRM_MODE_PAGE_FLIP_EVENT | DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+    if (ret) {
+        err("drmModeAtomicCommit failed: %s\n", strerror(errno));
+        drmModeAtomicSetCursor(pdev->req, 0);
+        return ret;
+    }
+    trace_end(TRACE_COMMIT, t, buf->pts);
+    osd_committed();
+    drm_modeset_committed();
+
+    t = trace_begin();
+    do {
+        ret = select(pdev->fd + 1, &fds, NULL, NULL, NULL);
+    } while (ret == -1 && errno == EINTR);
+
+    if (FD_ISSET(pdev->fd, &fds))
+        drmHandleEvent(pdev->fd, &pdev->drm_event_ctx);
+    trace_end(TRACE_FLIP, t, buf->pts);
+    wb_capture(buf->pts);
+
+    /* rewind the request instead of reallocating it */
+    drmModeAtomicSetCursor(pdev->req, 0);
+
+    return 0;
+}
+
+static int drm_dmabuf_addfb(struct drm_buffer *buf, uint32_t width, uint32_t height)
+{
+    int ret;
+
+    width = ALIGN(width, 8);
+
+    ret = drmModeAddFB2WithModifiers(pdev->fd, width, height, buf->fourcc, buf->handles, buf->pitches, buf->offsets, buf->modifiers, &buf->fb_handle, 0);
+    if (ret) {
+        err("drmModeAddFB2 failed: %d (%s). width=%u, height=%u\n", ret, strerror(errno), width, height);
+        return ret;
+    }
+
+    return 0;
+}
+
+static void fcc2s(char *fmtString, unsigned int size, unsigned int pixelformat)
+{
+    if (size < 8) {
+        fmtString[0] = '\0';
+        return;
+    }
+
+    fmtString[0] = pixelformat & 0x7f;
+    fmtString[1] = (pixelformat >> 8) & 0x7f;
+    fmtString[2] = (pixelformat >> 16) & 0x7f;
+    fmtString[3] = (pixelformat >> 24) & 0x7f;
+    if (pixelformat & (1 << 31)) {
+        fmtString[4] = '-';
+        fmtString[5] = 'B';
         fmtString[6] = 'E';
         fmtString[7] = '\0';
     } else {
-        fmtString[4] = '\0';
+        fmtString[4] = '\0';
+    }
+    return;
+}
+
+/* first plane of the CRTC that takes fourcc and is not in taken[] */
+static int find_plane(int fd, unsigned int fourcc, uint32_t * plane_id, uint32_t crtc_id, uint32_t crtc_idx,
+                      const uint32_t * taken, int nb_taken)
+{
+    drmModePlaneResPtr planes;
+    drmModePlanePtr plane;
+    unsigned int i;
+    unsigned int j;
+    int ret = 0;
+    unsigned int format = fourcc;
+    char fmtStringObtained[16] = { 0 };
+
+
+    planes = drmModeGetPlaneResources(fd);
+    if (!planes) {
+        err("drmModeGetPlaneResources failed\n");
+        return -1;
+    }
+
+    // dbg("found planes %u", planes->count_planes);
+
+    for (i = 0; i < planes->count_planes; ++i) {
+        plane = drmModeGetPlane(fd, planes->planes[i]);
+        if (!plane) {
+            err("drmModeGetPlane failed: %s\n", strerror(errno));
+            break;
+        }
+
+        if (!(plane->possible_crtcs & (1 << crtc_idx))) {
+            drmModeFreePlane(plane);
+            continue;
+        }
+
+        for (j = 0; j < nb_taken && taken[j] != plane->plane_id; j++);
+        if (j < nb_taken) {
+            drmModeFreePlane(plane);
+            continue;
+        }
+
+        for (j = 0; j < plane->count_formats; ++j) {
+            // fcc2s(fmtStringObtained, 8, plane->formats[j]);
+            // print("Pixel format plane[%d]: %s (%#x)\n", j, fmtStringObtained, plane->formats[j]);
+            if (plane->formats[j] == format)
+                break;
+        }
+
+        if (j == plane->count_formats) {
+            drmModeFreePlane(plane);
+            continue;
+        }
+
+        *plane_id = plane->plane_id;
+        drmModeFreePlane(plane);
+        break;
+    }
+
+    if (i == planes->count_planes)
+        ret = -1;
+
+    drmModeFreePlaneResources(planes);
+
+    return ret;
+}
+
+static int plane_has_format(int fd, uint32_t plane_id, unsigned int fourcc)
+{
+    drmModePlanePtr plane;
+    unsigned int i;
+    int found = 0;
+
+    plane = drmModeGetPlane(fd, plane_id);
+    if (!plane)
+        return 0;
+    for (i = 0; i < plane->count_formats && !found; i++)
+        found = plane->formats[i] == fourcc;
+    drmModeFreePlane(plane);
+
+    return found;
+}
+
+static struct drm_dev *drm_find_dev(int fd)
+{
+    int i;
+    struct drm_dev *dev = NULL, *dev_head = NULL;
+    drmModeRes *res;
+    drmModeConnector *conn;
+    drmModeEncoder *enc;
+    drmModeCrtc *crtc = NULL;
+
+    if ((res = drmModeGetResources(fd)) == NULL) {
+        err("drmModeGetResources() failed");
+        return NULL;
+    }
+
+    if (res->count_crtcs <= 0) {
+        err("no Crtcs");
+        goto free_res;
+    }
+
+    /* find all available connectors */
+    for (i = 0; i < res->count_connectors; i++) {
+        conn = drmModeGetConnector(fd, res->connectors[i]);
+
+        if (conn) {
+            if (conn->connection == DRM_MODE_CONNECTED) {
+                dbg("connector: connected");
+            } else if (conn->connection == DRM_MODE_DISCONNECTED) {
+                dbg("connector: disconnected");
+            } else if (conn->connection == DRM_MODE_UNKNOWNCONNECTION) {
+                dbg("connector: unknownconnection");
+            } else {
+                dbg("connector: unknown");
+            }
+        }
+
+        /* a writeback connector is a capture sink, not a display */
+        if (conn != NULL && conn->connection == DRM_MODE_CONNECTED && conn->count_modes > 0 &&
+            conn->connector_type != DRM_MODE_CONNECTOR_WRITEBACK) {
+            dev = (struct drm_dev *) malloc(sizeof(struct drm_dev));
+            memset(dev, 0, sizeof(struct drm_dev));
+
+            dev->conn_id = conn->connector_id;
+            dev->enc_id = conn->encoder_id;
+            dev->next = NULL;
+
+            memcpy(&dev->mode, &conn->modes[0], sizeof(drmModeModeInfo));
+            dev->width = conn->modes[0].hdisplay;
+            dev->height = conn->modes[0].vdisplay;
+
+            if (conn->encoder_id) {
+                enc = drmModeGetEncoder(fd, conn->encoder_id);
+                if (!enc) {
+                    err("drmModeGetEncoder() failed");
+                    goto free_res;
+                }
+                if (enc->crtc_id) {
+                    crtc = drmModeGetCrtc(fd, enc->crtc_id);
+                    if (crtc) {
+                        dev->crtc_id = enc->crtc_id;
+                        drmModeFreeCrtc(crtc);
+                    }
+                }
+                drmModeFreeEncoder(enc);
+            }
+
+            dev->saved_crtc = NULL;
+
+            /* create dev list */
+            dev->next = dev_head;
+            dev_head = dev;
+        }
+        drmModeFreeConnector(conn);
+    }
+
+    dev->crtc_idx = -1;
+
+    for (i = 0; i < res->count_crtcs; ++i) {
+        if (dev->crtc_id == res->crtcs[i]) {
+            dev->crtc_idx = i;
+            break;
+        }
+    }
+
+    if (dev->crtc_idx == -1)
+        err("drm: CRTC not found\n");
+
+  free_res:
+    drmModeFreeResources(res);
+
+    return dev_head;
+}
+
+static int drm_open(const char *path)
+{
+    int fd, flags;
+    uint64_t has_dumb;
+    int ret;
+
+    fd = open(path, O_RDWR);
+    if (fd < 0) {
+        err("cannot open \"%s\"\n", path);
+        return -1;
+    }
+
+    /* set FD_CLOEXEC flag */
+    if ((flags = fcntl(fd, F_GETFD)) < 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0) {
+        err("fcntl FD_CLOEXEC failed\n");
+        goto err;
+    }
+
+    /* check capability */
+    ret = drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &has_dumb);
+    if (ret < 0 || has_dumb == 0) {
+        err("drmGetCap DRM_CAP_DUMB_BUFFER failed or doesn't have dumb " "buffer\n");
+        goto err;
+    }
+
+    return fd;
+  err:
+    close(fd);
+    return -1;
+}
+
+static int drm_init(unsigned int fourcc, const char *device)
+{
+    struct drm_dev *dev_head, *dev;
+    drmModeAtomicReq *req;
+    int fd;
+    int ret;
+
+    fd = drm_open(device);
+    if (fd < 0)
+        return -1;
+
+    ret = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
+    if (ret) {
+        err("No atomic modesetting support: %s\n", strerror(errno));
+        goto err;
+    }
+
+    /* writeback connectors are only listed once the client asks for them */
+    if (wb.enabled && drmSetClientCap(fd, DRM_CLIENT_CAP_WRITEBACK_CONNECTORS, 1)) {
+        err("No writeback connector support: %s\n", strerror(errno));
+        goto err;
+    }
+
+    req = drmModeAtomicAlloc();
+
+    dev_head = drm_find_dev(fd);
+    if (dev_head == NULL) {
+        err("available drm devices not found\n");
+        goto err;
+    }
+
+    dbg("available connector(s)");
+
+    for (dev = dev_head; dev != NULL; dev = dev->next) {
+        dbg("connector id:%d", dev->conn_id);
+        dbg("\tencoder id:%d crtc id:%d", dev->enc_id, dev->crtc_id);
+        dbg("\twidth:%d height:%d", dev->width, dev->height);
+    }
+
+    /* FIXME: use first drm_dev */
+    dev = dev_head;
+    dev->fd = fd;
+    dev->req = req;
+    pdev = dev;
+
+    pdev->drm_event_ctx.version = DRM_EVENT_CONTEXT_VERSION;
+    pdev->drm_event_ctx.page_flip_handler = page_flip_handler;
+
+    /* coordinator: planes are taken per worker */
+    if (!fourcc)
+        return 0;
+
+    ret = find_plane(fd, fourcc, &dev->plane_id, dev->crtc_id, dev->crtc_idx, NULL, 0);
+    if (ret) {
+        err("Cannot find plane: %c%c%c%c", (fourcc >> 0) & 0xff, (fourcc >> 8) & 0xff, (fourcc >> 16) & 0xff, (fourcc >> 24) & 0xff);
+        goto err;
+    }
+
+    ret = drm_get_plane_props(fd, dev->plane_id);
+    if ((modeset.match_rate || modeset.width || modeset.vrr) && drm_modeset_init(fd))
+        goto err;
+    if (osd_plane_id && osd_init(osd_plane_id))
+        err("OSD disabled on plane %d", osd_plane_id);
+    if (wb.enabled && wb_init(fd))
+        goto err;
+
+    dbg("\tFound %c%c%c%c plane_id: %u\n", (fourcc >> 0) & 0xff, (fourcc >> 8) & 0xff, (fourcc >> 16) & 0xff, (fourcc >> 24) & 0xff, dev->plane_id);
+
+    return 0;
+
+  err:
+    close(fd);
+    pdev = NULL;
+    return -1;
+}
+
+static void drm_buf_pool_init(void)
+{
+    int i;
+
+    drm_buf_free = NULL;
+    for (i = 0; i < DRM_BUF_POOL_SIZE; i++) {
+        if (!drm_buf_pool[i].frame && !(drm_buf_pool[i].frame = av_frame_alloc()))
+            continue;
+        drm_buf_pool[i].next = drm_buf_free;
+        drm_buf_free = &drm_buf_pool[i];
+    }
+}
+
+static struct drm_buffer *drm_buf_get(void)
+{
+    struct drm_buffer *buf = drm_buf_free;
+    AVFrame *frame;
+
+    if (!buf) {
+        /* pool exhausted: should never happen, fall back to the heap */
+        pool_misses++;
+        buf = calloc(1, sizeof(*buf));
+        if (buf && !(buf->frame = av_frame_alloc())) {
+            free(buf);
+            return NULL;
+        }
+        if (buf)
+            metrics_inc(drm_buffers);
+        return buf;
+    }
+
+    drm_buf_free = buf->next;
+    frame = buf->frame;
+    memset(buf, 0, sizeof(*buf));
+    buf->frame = frame;
+    metrics_inc(drm_buffers);
+
+    return buf;
+}
+
+static void drm_buf_put(struct drm_buffer *buf)
+{
+    atomic_fetch_sub_explicit(&metrics->drm_buffers, 1, memory_order_relaxed);
+
+    if (buf < drm_buf_pool || buf >= drm_buf_pool + DRM_BUF_POOL_SIZE) {
+        av_frame_free(&buf->frame);
+        free(buf);
+        return;
+    }
+
+    buf->next = drm_buf_free;
+    drm_buf_free = buf;
+}
+
+/* framebuffer, GEM handles and decoder picture of an imported picture */
+static void drm_buf_release(struct drm_buffer *drm_buf)
+{
+    struct drm_gem_close gem_close;
+    AVFrame *frame = drm_buf->frame;
+    int i;
+
+    if (drm_buf->fb_handle && drmModeRmFB(pdev->fd, drm_buf->fb_handle))
+        err("cant remove fb %d\n", drm_buf->fb_handle);
+
+    for (i = 0; i < AV_DRM_MAX_PLANES; i++) {
+        if (drm_buf->bo_handles[i]) {
+            memset(&gem_close, 0, sizeof gem_close);
+            gem_close.handle = drm_buf->bo_handles[i];
+            if (drmIoctl(pdev->fd, DRM_IOCTL_GEM_CLOSE, &gem_close) < 0)
+                err("cant close gem: %s\n", strerror(errno));
+        }
+    }
+    mem_add(&mem.imported, &mem.imported_peak, -(int64_t) drm_buf->size);
+
+    /* off screen: the decoder may reuse the buffer now */
+    if (frame)
+        av_frame_unref(frame);
+    memset(drm_buf, 0, sizeof(*drm_buf));
+    drm_buf->frame = frame;
+}
+
+static void drm_remove_fb(struct drm_buffer *drm_buf)
+{
+    /* software frame: the framebuffer is reused */
+    if (!drm_buf->dumb)
+        drm_buf_release(drm_buf);
+    drm_buf_put(drm_buf);
+}
+
+/* drop the display ring, the last picture stays scanned out until the fd is closed */
+static void drm_release_bufs(void)
+{
+    if (!pdev)
+        return;
+
+    if (pdev->bufs[0])
+        drm_remove_fb(pdev->bufs[0]);
+    if (pdev->bufs[1])
+        drm_remove_fb(pdev->bufs[1]);
+    pdev->bufs[0] = pdev->bufs[1] = NULL;
+}
+
+static int display(struct drm_buffer *drm_buf, int width, int height, AVRational sar)
+{
+    int ret;
+    int64_t t;
+
+    if (!drm_buf->dumb) {
+        t = trace_begin();
+        ret = drm_dmabuf_addfb(drm_buf, width, height);
+        if (ret) {
+            err("cannot add framebuffer %d\n", ret);
+            drm_remove_fb(drm_buf);
+            return -EFAULT;
+        }
+        trace_end(TRACE_ADDFB, t, drm_buf->pts);
+    }
+
+    if (drm_dmabuf_set_plane(drm_buf, width, height, 1, sar)) {
+        /* the previous picture stays on screen */
+        metrics_inc(commit_errors);
+        drm_remove_fb(drm_buf);
+        return -EIO;
+    }
+    metrics_inc(frames_presented);
+    timing_mark(first_flip);
+    timing_report();
+    rt_lock_memory();
+    mem_report_periodic();
+    alloc_start();
+
+    if (pdev->bufs[1])
+        drm_remove_fb(pdev->bufs[1]);
+
+    pdev->bufs[1] = pdev->bufs[0];
+    pdev->bufs[0] = drm_buf;
+    metrics_set(display_queue, !!pdev->bufs[0] + !!pdev->bufs[1]);
+
+    return 0;
+}
+
+
+/* offset of the first timestamp, seek positions are relative to it */
+static int64_t pipeline_start_time(const struct pipeline *p)
+{
+    return p->input_ctx->start_time == AV_NOPTS_VALUE ? 0 : p->input_ctx->start_time;
+}
+
+static int64_t frame_pts(struct pipeline *p, AVFrame * frame)
+{
+    AVStream *st = p->input_ctx->streams[p->video_stream];
+    int64_t ts = frame->best_effort_timestamp;
+
+    if (ts == AV_NOPTS_VALUE)
+        return trick.last_pts;
+
+    return av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q);
+}
+
+/* convert a software frame into the next XRGB8888 dumb buffer */
+static int sw_upload(AVFrame * frame, struct drm_buffer *drm_buf)
+{
+    struct dumb_buffer *b;
+    uint8_t *dst[4] = { NULL };
+    int dst_stride[4] = { 0 };
+    int i;
+
+    if (frame->width != sw.width || frame->height != sw.height) {
+        /* new geometry: the pictures on screen go with the old buffers */
+        sw.width = sw.height = 0;
+        for (i = 0; i < SW_BUFFERS; i++) {
+            dumb_buffer_destroy(&sw.bufs[i]);
+            if (dumb_buffer_create(&sw.bufs[i], frame->width, frame->height, DRM_FORMAT_XRGB8888))
+                return AVERROR(ENOMEM);
+        }
+        sw.width = frame->width;
+        sw.height = frame->height;
+        dbg("software frames: %s %dx%d, %d buffers", av_get_pix_fmt_name(frame->format),
+            frame->width, frame->height, SW_BUFFERS);
+    }
+
+    sw.sws = sws_getCachedContext(sw.sws, frame->width, frame->height, frame->format,
+                                  frame->width, frame->height, AV_PIX_FMT_BGR0, SWS_POINT, NULL, NULL, NULL);
+    if (!sw.sws) {
+        err("No conversion from %s\n", av_get_pix_fmt_name(frame->format));
+        return AVERROR(EINVAL);
+    }
+
+    b = &sw.bufs[sw.next];
+    sw.next = (sw.next + 1) % SW_BUFFERS;
+    dst[0] = (uint8_t *) b->map;
+    dst_stride[0] = b->pitch;
+    sws_scale(sw.sws, (const uint8_t * const *) frame->data, frame->linesize, 0, frame->height, dst, dst_stride);
+
+    drm_buf->fb_handle = b->fb;
+    drm_buf->fourcc = DRM_FORMAT_XRGB8888;
+    drm_buf->dumb = 1;
+
+    return 0;
+}
+
+static void sw_free(void)
+{
+    int i;
+
+    for (i = 0; i < SW_BUFFERS && pdev; i++)
+        dumb_buffer_destroy(&sw.bufs[i]);
+    sws_freeContext(sw.sws);
+    sw.sws = NULL;
+    sw.width = sw.height = 0;
+}
+
+/* close the device: the next picture opens it again, with a plane for its own format */
+static void drm_deinit(void)
+{
+    struct drm_dev *dev, *next;
+    uint32_t i;
+
+    if (!pdev)
+        return;
+
+    drm_release_bufs();
+    osd_free();
+    sw_free();
+    for (i = 0; i < WB_BUFFERS; i++)
+        dumb_buffer_destroy(&wb.bufs[i]);
+    free(wb.dump_row);
+    wb.dump_row = NULL;
+    wb.conn_id = 0;
+
+    for (i = 0; i < pdev->count_props; i++)
+        drmModeFreeProperty(pdev->props[i]);
+    drmModeAtomicFree(pdev->req);
+    close(pdev->fd);
+    for (dev = pdev; dev; dev = next) {
+        next = dev->next;
+        free(dev);
+    }
+    pdev = NULL;
+}
+
+/* import the dma-bufs of a DRM PRIME frame */
+static int prime_import(const AVDRMFrameDescriptor * desc, struct drm_buffer *drm_buf, unsigned int fourcc)
+{
+    const AVDRMLayerDescriptor *layer = &desc->layers[0];
+    int ret;
+    int64_t t;
+
+    t = trace_begin();
+    // convert Prime FD to GEM handle
+    for (int i = 0; i < desc->nb_objects; i++) {
+        ret = drmPrimeFDToHandle(pdev->fd, desc->objects[i].fd, &drm_buf->bo_handles[i]);
+        if (ret < 0) {
+            err("Failed FDToHandle\n");
+            return ret;
+        }
+        drm_buf->size += desc->objects[i].size;
+    }
+    mem_add(&mem.imported, &mem.imported_peak, drm_buf->size);
+    trace_end(TRACE_IMPORT, t, drm_buf->pts);
+
+    /* the first picture gives the real pool footprint */
+    if (active && !active->pool_measured && active->capture_buffers) {
+        int64_t pool = (int64_t) active->capture_buffers * drm_buf->size;
+
+        mem_add(&mem.pool, &mem.pool_peak, pool - active->pool_bytes);
+        active->pool_bytes = pool;
+        active->pool_measured = 1;
+    }
+
+    for (int i = 0; i < layer->nb_planes && i < AV_DRM_MAX_PLANES; i++) {
+        int object = layer->planes[i].object_index;
+        uint32_t handle = drm_buf->bo_handles[object];
+        if (handle && layer->planes[i].pitch) {
+            drm_buf->handles[i] = handle;
+            drm_buf->pitches[i] = layer->planes[i].pitch;
+            drm_buf->offsets[i] = layer->planes[i].offset;
+            drm_buf->modifiers[i] = desc->objects[object].format_modifier;
+        }
+    }
+
+    /* pass the format in the buffer */
+    drm_buf->fourcc = fourcc;
+
+    return 0;
+}
+
+/*
+ * Shared display: a coordinator holds DRM master, workers hand it their
+ * frames. A worker that crashes or hangs only loses its own plane.
+ */
+static int share_send(int fd, const struct share_msg *msg, const int *fds, int nb_fds)
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * AV_DRM_MAX_PLANES)];
+    struct iovec iov = {.iov_base = (void *) msg, .iov_len = sizeof(*msg) };
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nb_fds) {
+        memset(cbuf, 0, sizeof(cbuf));
+        mh.msg_control = cbuf;
+        mh.msg_controllen = CMSG_SPACE(sizeof(int) * nb_fds);
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nb_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nb_fds);
+    }
+
+    /* a peer that does not read its socket is not waited for */
+    return sendmsg(fd, &mh, MSG_NOSIGNAL | MSG_DONTWAIT) == sizeof(*msg) ? 0 : -1;
+}
+
+/* one message and its fds: the number of fds, -1 on error or a closed connection */
+static int share_recv(int fd, struct share_msg *msg, int *fds, int max_fds)
+{
+    char cbuf[CMSG_SPACE(sizeof(int) * AV_DRM_MAX_PLANES)];
+    struct iovec iov = {.iov_base = msg, .iov_len = sizeof(*msg) };
+    struct msghdr mh;
+    struct cmsghdr *cmsg;
+    ssize_t n;
+    int i, count, received, nb_fds = 0;
+
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf;
+    mh.msg_controllen = sizeof(cbuf);
+
+    do {
+        n = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+        return -1;
+
+    for (cmsg = CMSG_FIRSTHDR(&mh); cmsg; cmsg = CMSG_NXTHDR(&mh, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+            continue;
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0; i < count; i++) {
+            memcpy(&received, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            if (nb_fds < max_fds)
+                fds[nb_fds++] = received;
+            else
+                close(received);
+        }
+    }
+
+    if (n != sizeof(*msg) || (mh.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+        while (nb_fds)
+            close(fds[--nb_fds]);
+        return -1;
+    }
+
+    return nb_fds;
+}
+
+/* worker: register with the coordinator, the region defaults to its whole screen */
+static int share_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    struct share_msg msg;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        err("coordinator socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    share.shown = av_frame_alloc();
+    if (!share.shown)
+        return AVERROR(ENOMEM);
+
+    share.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (share.fd < 0 || connect(share.fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        err("coordinator %s: %s", path, strerror(errno));
+        goto err;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = SHARE_HELLO;
+    msg.version = SHARE_VERSION;
+    if (share_send(share.fd, &msg, NULL, 0) || share_recv(share.fd, &msg, NULL, 0) < 0 || msg.type != SHARE_WELCOME) {
+        err("coordinator %s refused the connection", path);
+        goto err;
+    }
+
+    share.vrefresh = msg.vrefresh;
+    if (!share.w || !share.h) {
+        share.x = share.y = 0;
+        share.w = msg.width;
+        share.h = msg.height;
+    }
+    info("shared display %ux%u, region %ux%u+%d+%d", msg.width, msg.height, share.w, share.h, share.x, share.y);
+
+    return 0;
+  err:
+    if (share.fd >= 0)
+        close(share.fd);
+    share.fd = -1;
+    return -1;
+}
+
+/* worker: hand the picture over and wait until it is on screen, as after our own commit */
+static int share_present(AVFrame * frame, unsigned int fourcc)
+{
+    const AVDRMFrameDescriptor *desc = (const AVDRMFrameDescriptor *) frame->data[0];
+    struct share_msg msg;
+    int fds[AV_DRM_MAX_PLANES];
+    uint32_t x, y;
+    int64_t t;
+    int i;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = SHARE_FRAME;
+    msg.width = frame->width;
+    msg.height = frame->height;
+    msg.fourcc = fourcc;
+    msg.pts = frame->pts;
+    msg.desc = *desc;
+    fit_rect(frame->width, frame->height, frame->sample_aspect_ratio, share.w, share.h, &x, &y, &msg.crtc_w, &msg.crtc_h);
+    msg.crtc_x = share.x + x;
+    msg.crtc_y = share.y + y;
+    for (i = 0; i < desc->nb_objects; i++)
+        fds[i] = desc->objects[i].fd;
+
+    t = trace_begin();
+    if (share_send(share.fd, &msg, fds, desc->nb_objects) || share_recv(share.fd, &msg, NULL, 0) < 0) {
+        err("coordinator closed the connection\n");
+        exit(1);
+    }
+    trace_end(TRACE_FLIP, t, frame->pts);
+
+    if (msg.type != SHARE_PRESENTED) {
+        /* the previous picture stays on screen */
+        metrics_inc(commit_errors);
+        return -EIO;
+    }
+    metrics_flip(msg.sequence, msg.tv_sec, msg.tv_usec);
+    metrics_inc(frames_presented);
+    timing_mark(first_flip);
+    timing_report();
+    rt_lock_memory();
+    mem_report_periodic();
+    alloc_start();
+
+    /* the previous picture went off screen with this flip */
+    av_frame_unref(share.shown);
+    av_frame_move_ref(share.shown, frame);
+
+    return 0;
+}
+
+static void share_unlink(void)
+{
+    unlink(share.listen_path);
+}
+
+static void share_signal(int sig)
+{
+    share_stop = 1;
+}
+
+static int share_listen(const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        err("coordinator socket path too long: %s", path);
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    share.listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (share.listen_fd < 0) {
+        err("coordinator socket: %s", strerror(errno));
+        return -1;
+    }
+
+    unlink(path);
+    if (bind(share.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        (share.mode && chmod(path, share.mode) < 0) || listen(share.listen_fd, SHARE_MAX_CLIENTS) < 0) {
+        err("coordinator socket %s: %s", path, strerror(errno));
+        close(share.listen_fd);
+        share.listen_fd = -1;
+        return -1;
+    }
+    atexit(share_unlink);
+
+    return 0;
+}
+
+static void share_client_reset(struct share_client *c)
+{
+    int i;
+
+    for (i = 0; i < 3; i++)
+        drm_buf_release(&c->bufs[i]);
+    if (c->fd >= 0)
+        close(c->fd);
+    memset(c, 0, sizeof(*c));
+    c->fd = -1;
+}
+
+/* the plane stays up until a commit has disabled it */
+static void share_drop(struct share_client *c)
+{
+    info("worker %d: disconnected", (int) (c - share.clients));
+
+    close(c->fd);
+    c->fd = -1;
+    if (c->pending) {
+        drm_buf_release(c->pending);
+        c->pending = NULL;
+    }
+    if (c->queued || c->shown)
+        c->gone = 1;
+    else
+        share_client_reset(c);
+}
+
+static void share_reply(struct share_client *c, struct share_msg *msg)
+{
+    if (c->fd >= 0 && share_send(c->fd, msg, NULL, 0))
+        share_drop(c);
+}
+
+static void share_reply_dropped(struct share_client *c)
+{
+    struct share_msg msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = SHARE_DROPPED;
+    share_reply(c, &msg);
+}
+
+static void share_accept(void)
+{
+    struct share_client *c = NULL;
+    int i, fd;
+
+    fd = accept4(share.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+
+    for (i = 0; i < SHARE_MAX_CLIENTS && !c; i++)
+        if (share.clients[i].fd < 0 && !share.clients[i].gone)
+            c = &share.clients[i];
+    if (!c) {
+        err("%d workers already, connection refused", SHARE_MAX_CLIENTS);
+        close(fd);
+        return;
+    }
+
+    share_client_reset(c);
+    c->fd = fd;
+    info("worker %d: connected", (int) (c - share.clients));
+}
+
+/* the first frame decides the format, the plane is kept until the worker leaves */
+static int share_take_plane(struct share_client *c, unsigned int fourcc)
+{
+    static const char *const names[SHARE_PLANE_PROPS] = {
+        "FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H", "CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+    };
+    uint32_t taken[SHARE_MAX_CLIENTS];
+    char fmt[16] = { 0 };
+    int i, nb_taken = 0;
+
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++)
+        if (share.clients[i].plane_id)
+            taken[nb_taken++] = share.clients[i].plane_id;
+
+    fcc2s(fmt, 8, fourcc);
+    if (find_plane(pdev->fd, fourcc, &c->plane_id, pdev->crtc_id, pdev->crtc_idx, taken, nb_taken)) {
+        err("worker %d: no free plane for %s", (int) (c - share.clients), fmt);
+        return -1;
+    }
+
+    for (i = 0; i < SHARE_PLANE_PROPS; i++) {
+        c->props[i] = drm_object_prop(pdev->fd, c->plane_id, DRM_MODE_OBJECT_PLANE, names[i], NULL);
+        if (!c->props[i]) {
+            err("plane %u has no %s property", c->plane_id, names[i]);
+            c->plane_id = 0;
+            return -1;
+        }
+    }
+    info("worker %d: %s on plane %u", (int) (c - share.clients), fmt, c->plane_id);
+
+    return 0;
+}
+
+static int share_import(struct share_client *c, struct share_msg *msg, int *fds)
+{
+    struct drm_buffer *buf = NULL;
+    int i, ret;
+
+    for (i = 0; i < 3 && !buf; i++)
+        if (&c->bufs[i] != c->queued && &c->bufs[i] != c->shown)
+            buf = &c->bufs[i];
+
+    for (i = 0; i < msg->desc.nb_objects; i++)
+        msg->desc.objects[i].fd = fds[i];
+    buf->pts = msg->pts;
+
+    ret = prime_import(&msg->desc, buf, msg->fourcc);
+    if (ret < 0)
+        buf->size = 0;          /* not accounted yet */
+    else
+        ret = drm_dmabuf_addfb(buf, msg->width, msg->height);
+    for (i = 0; i < msg->desc.nb_objects; i++)
+        close(fds[i]);
+    if (ret) {
+        drm_buf_release(buf);
+        return ret;
+    }
+
+    c->pending = buf;
+    c->frame = *msg;
+
+    return 0;
+}
+
+/* the descriptor comes from another process: every count and index must stay in range */
+static int share_check_desc(const AVDRMFrameDescriptor * desc, int nb_fds)
+{
+    const AVDRMLayerDescriptor *layer = &desc->layers[0];
+    int i;
+
+    if (desc->nb_objects < 1 || desc->nb_objects > AV_DRM_MAX_PLANES || desc->nb_objects != nb_fds)
+        return -1;
+    if (desc->nb_layers < 1 || desc->nb_layers > AV_DRM_MAX_PLANES)
+        return -1;
+    if (layer->nb_planes < 1 || layer->nb_planes > AV_DRM_MAX_PLANES)
+        return -1;
+    for (i = 0; i < layer->nb_planes; i++)
+        if (layer->planes[i].object_index < 0 || layer->planes[i].object_index >= desc->nb_objects)
+            return -1;
+
+    return 0;
+}
+
+static void share_receive(struct share_client *c)
+{
+    struct share_msg msg;
+    int fds[AV_DRM_MAX_PLANES];
+    int i, nb_fds;
+
+    nb_fds = share_recv(c->fd, &msg, fds, AV_DRM_MAX_PLANES);
+    if (nb_fds < 0) {
+        share_drop(c);
+        return;
+    }
+
+    if (!c->hello) {
+        for (i = 0; i < nb_fds; i++)
+            close(fds[i]);
+        if (msg.type != SHARE_HELLO || msg.version != SHARE_VERSION) {
+            err("worker %d: protocol version mismatch", (int) (c - share.clients));
+            share_drop(c);
+            return;
+        }
+        c->hello = 1;
+        memset(&msg, 0, sizeof(msg));
+        msg.type = SHARE_WELCOME;
+        msg.width = pdev->width;
+        msg.height = pdev->height;
+        msg.vrefresh = pdev->mode.vrefresh;
+        share_reply(c, &msg);
+        return;
+    }
+
+    /* one frame at a time: the worker waits for the answer */
+    if (msg.type != SHARE_FRAME || c->pending || c->in_flight || share_check_desc(&msg.desc, nb_fds)) {
+        err("worker %d: protocol error", (int) (c - share.clients));
+        for (i = 0; i < nb_fds; i++)
+            close(fds[i]);
+        share_drop(c);
+        return;
+    }
+
+    if (!c->plane_id && share_take_plane(c, msg.fourcc)) {
+        for (i = 0; i < nb_fds; i++)
+            close(fds[i]);
+        share_drop(c);
+        return;
+    }
+
+    if (share_import(c, &msg, fds))
+        share_reply_dropped(c);
+}
+
+static int share_ready(const struct share_client *c)
+{
+    return (c->pending || c->gone) && !c->in_flight;
+}
+
+static int share_add_plane(drmModeAtomicReq * req, const struct share_client *c)
+{
+    const struct share_msg *f = &c->frame;
+    uint64_t values[SHARE_PLANE_PROPS];
+    int i, count = SHARE_PLANE_PROPS;
+
+    memset(values, 0, sizeof(values));
+    if (c->gone) {
+        /* FB_ID and CRTC_ID to 0 */
+        count = 2;
+    } else {
+        values[0] = c->pending->fb_handle;
+        values[1] = pdev->crtc_id;
+        values[4] = (uint64_t) f->width << 16;
+        values[5] = (uint64_t) f->height << 16;
+        values[6] = (int64_t) f->crtc_x;
+        values[7] = (int64_t) f->crtc_y;
+        values[8] = f->crtc_w;
+        values[9] = f->crtc_h;
+    }
+
+    for (i = 0; i < count; i++)
+        if (drmModeAtomicAddProperty(req, c->plane_id, c->props[i], values[i]) < 0)
+            return -1;
+
+    return 0;
+}
+
+static void share_reject(struct share_client *c)
+{
+    if (c->gone) {
+        share_client_reset(c);
+        return;
+    }
+
+    metrics_inc(commit_errors);
+    drm_buf_release(c->pending);
+    c->pending = NULL;
+    share_reply_dropped(c);
+}
+
+/* the driver refused the commit: drop the frames it refuses on their own, or all of them */
+static void share_isolate(void)
+{
+    struct share_client *c;
+    int i, rejected = 0;
+
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++) {
+        c = &share.clients[i];
+        if (!share_ready(c))
+            continue;
+        drmModeAtomicSetCursor(pdev->req, 0);
+        if (share_add_plane(pdev->req, c) < 0 ||
+            drmModeAtomicCommit(pdev->fd, pdev->req, DRM_MODE_ATOMIC_TEST_ONLY, NULL)) {
+            err("worker %d: frame refused", i);
+            share_reject(c);
+            rejected++;
+        }
+    }
+
+    for (i = 0; i < SHARE_MAX_CLIENTS && !rejected; i++)
+        if (share_ready(&share.clients[i]))
+            share_reject(&share.clients[i]);
+}
+
+/* everything received since the last flip goes in one commit */
+static void share_commit(void)
+{
+    struct share_client *c;
+    int i, nb = 0;
+    int64_t t;
+
+    if (share.flip_pending)
+        return;
+
+    drmModeAtomicSetCursor(pdev->req, 0);
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++) {
+        c = &share.clients[i];
+        if (!share_ready(c))
+            continue;
+        if (share_add_plane(pdev->req, c) < 0) {
+            share_isolate();
+            share_commit();
+            return;
+        }
+        nb++;
+    }
+    if (!nb)
+        return;
+
+    t = trace_begin();
+    if (drmModeAtomicCommit(pdev->fd, pdev->req, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT, NULL)) {
+        err("drmModeAtomicCommit failed: %s\n", strerror(errno));
+        /* the frames that passed go now: nothing else may wake up their workers */
+        share_isolate();
+        share_commit();
+        return;
+    }
+    trace_end(TRACE_COMMIT, t, AV_NOPTS_VALUE);
+
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++) {
+        c = &share.clients[i];
+        if (!share_ready(c))
+            continue;
+        c->in_flight = 1;
+        c->queued = c->pending;
+        c->pending = NULL;
+    }
+    share.flip_pending = 1;
+}
+
+static void share_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec, unsigned int tv_usec, void *user_data)
+{
+    struct share_client *c;
+    struct share_msg msg;
+    int i;
+
+    share.flip_pending = 0;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.type = SHARE_PRESENTED;
+    msg.sequence = sequence;
+    msg.tv_sec = tv_sec;
+    msg.tv_usec = tv_usec;
+
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++) {
+        c = &share.clients[i];
+        if (!c->in_flight)
+            continue;
+        c->in_flight = 0;
+
+        /* a disabling commit: the plane is free again */
+        if (c->gone && !c->queued) {
+            share_client_reset(c);
+            continue;
+        }
+
+        if (c->shown)
+            drm_buf_release(c->shown);
+        c->shown = c->queued;
+        c->queued = NULL;
+        metrics_inc(frames_presented);
+        share_reply(c, &msg);
+    }
+}
+
+/* coordinator: runs until SIGINT or SIGTERM */
+static int share_serve(const char *device)
+{
+    struct pollfd fds[SHARE_MAX_CLIENTS + 2];
+    struct share_client *clients[SHARE_MAX_CLIENTS + 2];
+    int i, nfds;
+
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++)
+        share.clients[i].fd = -1;
+
+    if (drm_init(0, device) || share_listen(share.listen_path))
+        return 1;
+    pdev->drm_event_ctx.page_flip_handler = share_flip_handler;
+    signal(SIGINT, share_signal);
+    signal(SIGTERM, share_signal);
+
+    info("coordinator on %s: CRTC %u, %ux%u %s", share.listen_path, pdev->crtc_id, pdev->width, pdev->height,
+         pdev->mode.name);
+
+    while (!share_stop) {
+        nfds = 0;
+        fds[nfds].fd = pdev->fd;
+        fds[nfds++].events = POLLIN;
+        fds[nfds].fd = share.listen_fd;
+        fds[nfds++].events = POLLIN;
+        for (i = 0; i < SHARE_MAX_CLIENTS; i++) {
+            if (share.clients[i].fd < 0)
+                continue;
+            clients[nfds] = &share.clients[i];
+            fds[nfds].fd = share.clients[i].fd;
+            fds[nfds++].events = POLLIN;
+        }
+
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            err("poll: %s", strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+            drmHandleEvent(pdev->fd, &pdev->drm_event_ctx);
+        if (fds[1].revents & POLLIN)
+            share_accept();
+        for (i = 2; i < nfds; i++)
+            if (fds[i].revents && clients[i]->fd == fds[i].fd)
+                share_receive(clients[i]);
+
+        share_commit();
+    }
+
+    /* closing the device takes the planes down with their framebuffers */
+    for (i = 0; i < SHARE_MAX_CLIENTS; i++)
+        share_client_reset(&share.clients[i]);
+    close(share.listen_fd);
+
+    return 0;
+}
+
+/* DRM format a frame is shown in: its own for PRIME, XRGB8888 after conversion */
+static unsigned int frame_fourcc(const AVFrame * frame)
+{
+    const AVDRMFrameDescriptor *desc;
+    unsigned int fourcc;
+
+    if (frame->format != AV_PIX_FMT_DRM_PRIME)
+        return DRM_FORMAT_XRGB8888;
+
+    desc = (const AVDRMFrameDescriptor *) frame->data[0];
+    fourcc = desc->layers[0].format;
+    if (fourcc == DRM_FORMAT_NV12_10)
+        fourcc = DRM_FORMAT_NV15;
+
+    return fourcc;
+}
+
+/* import a decoded DRM PRIME frame, or convert a software one, and put it on screen */
+static int display_frame(AVFrame * frame, const char *device)
+{
+    struct drm_buffer *drm_buf = NULL;
+    unsigned int fourcc = frame_fourcc(frame);
+    int prime = frame->format == AV_PIX_FMT_DRM_PRIME;
+    int ret, width, height;
+    AVRational sar;
+    char fmtStringObtained[16] = { 0 };
+
+    if (null_display) {
+        metrics_inc(frames_presented);
+        alloc_start();
+        return 0;
+    }
+
+    if (share.fd >= 0) {
+        if (!prime) {
+            err("--share needs a decoder with DRM PRIME output\n");
+            exit(1);
+        }
+        return share_present(frame, fourcc);
+    }
+
+    if (!pdev) {
+        /* remember the format */
+        drm_format = fourcc;
+
+        fcc2s(fmtStringObtained, 8, drm_format);
+        print("Pixel format avframe: %s (%#x)\n", fmtStringObtained, drm_format);
+        /* initialize DRM with the format returned in the frame */
+        ret = drm_init(drm_format, device);
+        if (ret) {
+            err("Initializing drm\n");
+            exit(1);
+        }
+    }
+
+    drm_buf = drm_buf_get();
+    if (!drm_buf) {
+        err("Out of drm buffers\n");
+        return AVERROR(ENOMEM);
+    }
+    drm_buf->pts = frame->pts;
+
+    ret = prime ? prime_import((AVDRMFrameDescriptor *) frame->data[0], drm_buf, fourcc) : sw_upload(frame, drm_buf);
+    if (ret < 0) {
+        drm_buf_put(drm_buf);
+        return ret;
+    }
+
+    osd_update(frame_pts(active, frame));
+    width = frame->width;
+    height = frame->height;
+    sar = frame->sample_aspect_ratio;
+    /* the decoder must not write into a picture that is scanned out */
+    if (prime)
+        av_frame_move_ref(drm_buf->frame, frame);
+    ret = display(drm_buf, width, height, sar);
+    if (ret < 0) {
+        err("Display Failed!\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+static int64_t trick_frame_duration(void)
+{
+    return content_fps > 0 ? AV_TIME_BASE / content_fps : AV_TIME_BASE / 25;
+}
+
+static int trick_keyframes_only(void)
+{
+    return abs(trick.rate) >= TRICK_KEYFRAME_RATE;
+}
+
+static int64_t trick_media_time(void)
+{
+    return trick.base_pts + (monotonic_us() - trick.base_wall) * trick.rate;
+}
+
+/*
+ * Decide whether a picture at pts is shown: early ones wait for the media
+ * clock, late ones are dropped, except keyframes in keyframe mode which are
+ * sparse already.
+ */
+static int trick_present(int64_t pts)
+{
+    int64_t ahead;
+
+    if (pts < trick.skip_until && trick.rate > 0)
+        return 0;
+    trick.skip_until = INT64_MIN;
+
+    if (trick.rate == 1 && !modeset.pace)
+        return 1;
+
+    /* stepping while paused: every picture is on time, the clock starts from it */
+    if (paused)
+        trick.anchored = 0;
+
+    if (!trick.anchored) {
+        trick.base_pts = pts;
+        trick.base_wall = monotonic_us();
+        trick.anchored = 1;
+    }
+
+    ahead = (pts - trick_media_time()) * (trick.rate > 0 ? 1 : -1);
+    if (ahead < -trick_frame_duration() && !trick_keyframes_only())
+        return 0;
+
+    if (ahead > 0)
+        usleep(FFMIN(ahead / abs(trick.rate), TRICK_MAX_WAIT));
+
+    return 1;
+}
+
+static void trick_gop_clear(void)
+{
+    int i;
+
+    for (i = 0; i < trick.gop_count; i++)
+        av_frame_unref(trick.gop[i]);
+    trick.gop_count = 0;
+}
+
+/* frames held for reverse playback come out of the decoder pool */
+static int trick_gop_capacity(void)
+{
+    int cap = active->capture_buffers ? (active->capture_buffers - 4) / 2 : 4;
+
+    if (trick_keyframes_only())
+        return 1;
+
+    return FFMAX(1, FFMIN(cap, TRICK_GOP_MAX));
+}
+
+/* keep the newest <capacity> frames: drop the oldest when full */
+static void trick_gop_push(AVFrame * frame)
+{
+    AVFrame *oldest;
+    int cap = trick_gop_capacity();
+
+    if (trick.gop_count == cap) {
+        oldest = trick.gop[0];
+        av_frame_unref(oldest);
+        memmove(trick.gop, trick.gop + 1, (cap - 1) * sizeof(*trick.gop));
+        trick.gop[cap - 1] = oldest;
+        trick.gop_count--;
+    }
+    av_frame_move_ref(trick.gop[trick.gop_count++], frame);
+}
+
+static int trick_seek(int64_t pts)
+{
+    AVStream *st = active->input_ctx->streams[active->video_stream];
+    int ret;
+
+    ret = av_seek_frame(active->input_ctx, active->video_stream,
+                        av_rescale_q(pts, AV_TIME_BASE_Q, st->time_base), AVSEEK_FLAG_BACKWARD);
+    if (ret < 0)
+        return ret;
+
+    avcodec_flush_buffers(active->codec_ctx);
+
+    return 0;
+}
+
+static int64_t trick_index_timestamp(AVStream * st, int idx)
+{
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+    return avformat_index_get_entry(st, idx)->timestamp;
+#else
+    return st->index_entries[idx].timestamp;
+#endif
+}
+
+static int trick_index_count(AVStream * st)
+{
+#if LIBAVFORMAT_VERSION_MAJOR >= 59
+    return avformat_index_get_entries_count(st);
+#else
+    return st->nb_index_entries;
+#endif
+}
+
+/* where reverse playback starts when nothing was shown yet: 0 if unknown */
+static int64_t trick_stream_end(void)
+{
+    AVFormatContext *ic = active->input_ctx;
+    AVStream *st = ic->streams[active->video_stream];
+    int count = trick_index_count(st);
+
+    if (ic->duration > 0)
+        return pipeline_start_time(active) + ic->duration;
+    if (count > 0)
+        return av_rescale_q(trick_index_timestamp(st, count - 1), st->time_base, AV_TIME_BASE_Q) + 1;
+
+    return 0;
+}
+
+/*
+ * Keyframe mode forward: jump straight to the last keyframe before the
+ * media clock when the index says sequential reading would go through
+ * keyframes that are already late.
+ */
+static void trick_seek_ahead(void)
+{
+    AVStream *st = active->input_ctx->streams[active->video_stream];
+    int64_t ts;
+    int next, target;
+
+    /* the decoder may hold pictures back: wait for the last seek to show before the next one */
+    if (trick.last_pts < trick.sought_pts)
+        return;
+
+    next = av_index_search_timestamp(st, av_rescale_q(trick.last_pts, AV_TIME_BASE_Q, st->time_base) + 1, 0);
+    target = av_index_search_timestamp(st, av_rescale_q(trick_media_time(), AV_TIME_BASE_Q, st->time_base),
+                                       AVSEEK_FLAG_BACKWARD);
+    if (next < 0 || target <= next)
+        return;
+
+    ts = trick_index_timestamp(st, target);
+    if (av_seek_frame(active->input_ctx, active->video_stream, ts, 0) >= 0) {
+        avcodec_flush_buffers(active->codec_ctx);
+        trick.sought_pts = av_rescale_q(ts, st->time_base, AV_TIME_BASE_Q);
+    }
+}
+
+/*
+ * Reverse: seek to the keyframe before the part not yet shown and decode
+ * forward up to it, keeping the newest frames. A GOP longer than the
+ * buffer is decoded again for its earlier part on the next fill.
+ */
+static int trick_reverse_fill(void)
+{
+    AVPacket pkt;
+    AVFrame *frame = active->frame;
+    int64_t end = FFMIN(trick.segment_end, trick_media_time());
+    int64_t pts;
+    int ret, done = 0, draining = 0;
+
+    if (end <= pipeline_start_time(active))
+        return 0;
+
+    ret = trick_seek(end - 1);
+    if (ret < 0)
+        return ret;
+
+    while (!done && !draining) {
+        ret = av_read_frame(active->input_ctx, &pkt);
+        if (ret == AVERROR(EAGAIN))
+            continue;
+        if (ret < 0) {
+            /* end of input: the last pictures of the stream are still in the decoder */
+            draining = 1;
+            ret = avcodec_send_packet(active->codec_ctx, NULL);
+        } else if (pkt.stream_index != active->video_stream ||
+                   (trick_keyframes_only() && !(pkt.flags & AV_PKT_FLAG_KEY))) {
+            av_packet_unref(&pkt);
+            continue;
+        } else {
+            ret = avcodec_send_packet(active->codec_ctx, &pkt);
+            av_packet_unref(&pkt);
+        }
+        if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            return ret;
+
+        while (!done && avcodec_receive_frame(active->codec_ctx, frame) == 0) {
+            pts = frame_pts(active, frame);
+            if (pts >= end) {
+                av_frame_unref(frame);
+                done = 1;
+                break;
+            }
+            trick_gop_push(frame);
+            done = trick_keyframes_only();
+        }
+    }
+
+    /* nothing before end in this GOP: step back further next time */
+    trick.segment_end = trick.gop_count ? frame_pts(active, trick.gop[0]) : end - AV_TIME_BASE;
+
+    return 0;
+}
+
+static int trick_reverse(const char *device)
+{
+    AVFrame *frame;
+    int64_t pts;
+    int ret;
+
+    if (!trick.gop_count) {
+        ret = trick_reverse_fill();
+        if (ret < 0)
+            return ret;
+        if (!trick.gop_count) {
+            if (trick.segment_end > pipeline_start_time(active))
+                return 0;
+            /* reached the start: hold the first picture if told what to do next, else stop */
+            avcodec_flush_buffers(active->codec_ctx);
+            if (control.listen_fd < 0)
+                return AVERROR_EOF;
+            paused = 1;
+            return 0;
+        }
+    }
+
+    frame = trick.gop[--trick.gop_count];
+    pts = frame_pts(active, frame);
+    if (trick_present(pts)) {
+        ret = display_frame(frame, device);
+        trick.last_pts = pts;
+    } else {
+        ret = 0;
+    }
+    av_frame_unref(frame);
+
+    return ret;
+}
+
+/* 1 is normal playback, negative rates play backwards */
+static int trick_set_rate(int rate)
+{
+    int prev = trick.rate, prev_keyframes = trick_keyframes_only();
+    int i;
+
+    if (!rate || abs(rate) > TRICK_MAX_RATE)
+        return AVERROR(EINVAL);
+
+    for (i = 0; i < TRICK_GOP_MAX; i++)
+        if (!trick.gop[i] && !(trick.gop[i] = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+
+    trick_gop_clear();
+    trick.rate = rate;
+    trick.base_pts = trick.last_pts;
+    trick.base_wall = monotonic_us();
+    trick.anchored = !!timing.first_flip;
+    trick.segment_end = trick.last_pts;
+    trick.sought_pts = INT64_MIN;
+
+    /* reverse from the start of playback: begin at the end of the stream */
+    if (rate < 0 && !timing.first_flip) {
+        trick.segment_end = trick.base_pts = trick_stream_end();
+        if (!trick.segment_end) {
+            err("reverse playback needs an input with a duration or an index\n");
+            trick.rate = prev;
+            return AVERROR(EINVAL);
+        }
+    }
+
+    /* ask the decoder to skip what will not be shown, hardware wrappers may ignore it */
+    if (trick_keyframes_only())
+        active->codec_ctx->skip_frame = AVDISCARD_NONKEY;
+    else if (rate >= 4)
+        active->codec_ctx->skip_frame = AVDISCARD_BIDIR;
+    else if (rate >= 2)
+        active->codec_ctx->skip_frame = AVDISCARD_NONREF;
+    else
+        active->codec_ctx->skip_frame = AVDISCARD_DEFAULT;
+
+    /* resume forward decoding from a keyframe once references were skipped */
+    if (rate > 0 && (prev < 0 || (prev_keyframes && !trick_keyframes_only()))) {
+        trick.skip_until = trick.last_pts + 1;
+        return trick_seek(trick.last_pts);
+    }
+
+    return 0;
+}
+
+/* create and open the video decoder of an opened input */
+static int pipeline_open_decoder(struct pipeline *p, const AVCodec *codec, const struct player_config *cfg)
+{
+    AVCodecParameters *codecpar = p->input_ctx->streams[p->video_stream]->codecpar;
+    AVDictionary *opts = NULL;
+    struct rt_saved saved;
+    int ret;
+
+    p->codec_ctx = avcodec_alloc_context3(codec);
+    if (!p->codec_ctx) {
+        err("Could not allocate video codec context\n");
+        return AVERROR(ENOMEM);
+    }
+
+    if (avcodec_parameters_to_context(p->codec_ctx, codecpar) < 0)
+        return -1;
+
+    /* For some codecs, such as msmpeg4 and mpeg4, width and height
+       MUST be initialized before opening the ffmpeg codec (ie, before
+       calling avcodec_open2) because this information is not available in
+       the bitstream). */
+    p->codec_ctx->pix_fmt = AV_PIX_FMT_DRM_PRIME;       /* request a DRM frame */
+    p->codec_ctx->coded_height = cfg->frame_height;
+    p->codec_ctx->coded_width = cfg->frame_width;
+    p->codec_ctx->get_format = get_format;
+    if (p->threads > 0)
+        p->codec_ctx->thread_count = p->threads;
+
+    if (p->capture_buffers > 0)
+        av_dict_set_int(&opts, "num_capture_buffers", p->capture_buffers, 0);
+    /* open it */
+    rt_decoder_enter(&saved);
+    ret = avcodec_open2(p->codec_ctx, codec, &opts);
+    rt_decoder_leave(&saved);
+    av_dict_free(&opts);
+    if (ret < 0) {
+        err("Could not open codec\n");
+        return ret;
+    }
+
+    return 0;
+}
+
+/*
+ * Replace a decoder that keeps failing. The pictures on screen hold
+ * their own GEM handles, so they stay valid; DRM is not touched. The old
+ * capture pool goes first: both at once may not fit in CMA.
+ */
+static int pipeline_reopen_decoder(struct pipeline *p)
+{
+    const AVCodec *codec = p->codec_ctx->codec;
+    enum AVDiscard skip_frame = p->codec_ctx->skip_frame;
+    int ret;
+
+    trick_gop_clear();
+    av_frame_unref(p->frame);
+    avcodec_free_context(&p->codec_ctx);
+
+    ret = pipeline_open_decoder(p, codec, &config);
+    if (ret < 0)
+        return ret;
+
+    /* trick play settings */
+    p->codec_ctx->skip_frame = skip_frame;
+    metrics_inc(decoder_reopens);
+
+    return 0;
+}
+
+/* a send or receive failure: flush, and after too many in a row reopen the decoder */
+static int resync_failure(struct pipeline *p, int ret)
+{
+    if (resync.policy == ERRORS_ABORT)
+        return ret;
+
+    resync.failures++;
+    resync.waiting_key = 1;
+    resync.key_since = monotonic_us();
+    resync.key_skipped = 0;
+    resync.hide_since = 0;
+    metrics_inc(resyncs);
+
+    if (resync.reopen_after && resync.failures >= resync.reopen_after) {
+        err("%d decoder failures in a row, reopening the decoder\n", resync.failures);
+        if (pipeline_reopen_decoder(p) < 0)
+            return ret;
+        resync.failures = 0;
+    } else {
+        avcodec_flush_buffers(p->codec_ctx);
+    }
+
+    return 0;
+}
+
+/* after a failure, packets are only sent again from a keyframe on, or once the wait is too long */
+static int resync_skip(const AVPacket * pkt)
+{
+    if (!resync.waiting_key)
+        return 0;
+    if (!(pkt->flags & AV_PKT_FLAG_KEY)) {
+        if (++resync.key_skipped < RESYNC_MAX_FRAMES &&
+            monotonic_us() - resync.key_since < RESYNC_TIMEOUT * 1000)
+            return 1;
+        dbg("no keyframe after %d packets, resync on pts %lld", resync.key_skipped, (long long) pkt->pts);
+    } else {
+        dbg("resync on keyframe, pts %lld", (long long) pkt->pts);
+    }
+    resync.waiting_key = 0;
+
+    return 0;
+}
+
+/*
+ * A concealed picture: dropped while the decoder recovers, from the first
+ * one up to a clean picture, within the same bounds. After that they are
+ * shown: a frozen picture is worse than a damaged one.
+ */
+static int resync_hide(void)
+{
+    int64_t now = monotonic_us();
+
+    if (!resync.hide_since) {
+        resync.hide_since = now;
+        resync.hidden = 0;
+    }
+    if (resync.hidden >= RESYNC_MAX_FRAMES || now - resync.hide_since >= RESYNC_TIMEOUT * 1000)
+        return 0;
+    if (++resync.hidden == RESYNC_MAX_FRAMES)
+        dbg("still concealing after %d pictures, showing them", resync.hidden);
+
+    return 1;
+}
+
+static void resync_report(void)
+{
+    uint64_t corrupt = atomic_load(&metrics->corrupt_frames);
+    uint64_t resyncs = atomic_load(&metrics->resyncs);
+
+    if (!corrupt && !resyncs && !atomic_load(&metrics->read_errors) && !atomic_load(&metrics->commit_errors))
+        return;
+
+    info("errors: send %llu, decode %llu, corrupt %llu, read %llu, commit %llu; %llu resyncs, %llu decoder reopens",
+         (unsigned long long) atomic_load(&metrics->send_errors),
+         (unsigned long long) atomic_load(&metrics->decode_errors),
+         (unsigned long long) corrupt,
+         (unsigned long long) atomic_load(&metrics->read_errors),
+         (unsigned long long) atomic_load(&metrics->commit_errors),
+         (unsigned long long) resyncs,
+         (unsigned long long) atomic_load(&metrics->decoder_reopens));
+}
+
+static int decode_and_display(AVCodecContext * dec_ctx, AVFrame * frame, AVPacket * pkt, const char *device)
+{
+    int ret, pending;
+    int64_t t, pts;
+
+    do {
+        t = trace_begin();
+        ret = avcodec_send_packet(dec_ctx, pkt);
+        /* the decoder is full: drain it and send the packet again */
+        pending = (ret == AVERROR(EAGAIN));
+        if (ret < 0 && !pending && ret != AVERROR_EOF) {
+            err("Sending a packet for decoding!\n");
+            metrics_inc(send_errors);
+            return resync_failure(active, ret);
+        }
+        if (!pending)
+            trace_end(TRACE_SEND, t, pkt ? pkt->pts : AV_NOPTS_VALUE);
+        ret = 0;
+        while (ret >= 0) {
+            t = trace_begin();
+            ret = avcodec_receive_frame(dec_ctx, frame);
+            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
+                //if (ret == AVERROR(EAGAIN)) {
+                //    err("avcodec_receive_frame EAGAIN\n"); 
+                //}
+                //usleep(10000);
+                break;
+            }
+            else if (ret < 0) {
+                err("Error during decoding\n");
+                metrics_inc(decode_errors);
+                return resync_failure(active, ret);
+            }
+            timing_mark(first_frame);
+            metrics_inc(frames_decoded);
+            trace_end(TRACE_RECEIVE, t, frame->pts);
+
+            /* concealed pictures are not shown while resyncing, the last good one stays up */
+            if ((frame->flags & AV_FRAME_FLAG_CORRUPT) || frame->decode_error_flags) {
+                metrics_inc(corrupt_frames);
+                if (resync.policy == ERRORS_RESYNC && resync_hide())
+                    continue;
+            } else {
+                resync.hide_since = 0;
+            }
+            resync.failures = 0;
+
+            pts = frame_pts(active, frame);
+            if (!trick_present(pts))
+                continue;
+
+            ret = display_frame(frame, device);
+            if (ret < 0) {
+                if (resync.policy == ERRORS_ABORT)
+                    return ret;
+                ret = 0;
+                continue;
+            }
+            trick.last_pts = pts;
+            if (step_frames > 0)
+                step_frames--;
+        }
+    } while (pending);
+
+    return 0;
+}
+
+/* keep a window of the mapping ahead of the read position in the page cache */
+static void mmap_input_advise(struct mmap_input *m)
+{
+    int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t start, end;
+
+    if (m->pos + m->window / 2 < m->readahead_end)
+        return;
+
+    start = FFMAX(m->pos, m->readahead_end) & ~(page - 1);
+    end = FFMIN(m->pos + m->window, m->size);
+    if (end > start)
+        madvise(m->data + start, end - start, MADV_WILLNEED);
+    m->readahead_end = end;
+}
+
+/*
+ * Pages of a mapped file that was truncated meanwhile raise SIGBUS. Each
+ * thread arms the guard around its own copy; any other SIGBUS is fatal as
+ * before.
+ */
+static __thread sigjmp_buf mmap_fault_jmp;
+static __thread volatile sig_atomic_t mmap_fault_armed;
+static pthread_once_t mmap_fault_once = PTHREAD_ONCE_INIT;
+
+static void mmap_fault_signal(int sig)
+{
+    if (mmap_fault_armed) {
+        mmap_fault_armed = 0;
+        siglongjmp(mmap_fault_jmp, 1);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+static void mmap_fault_install(void)
+{
+    struct sigaction sa = {.sa_handler = mmap_fault_signal };
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+static int mmap_input_read(void *opaque, uint8_t *buf, int size)
+{
+    struct mmap_input *m = opaque;
+    int64_t n = FFMIN(size, m->size - m->pos);
+    struct stat st;
+
+    if (n <= 0)
+        return AVERROR_EOF;
+
+    mmap_input_advise(m);
+    if (sigsetjmp(mmap_fault_jmp, 1)) {
+        /* the file shrank under the mapping: what is gone reads as the end of the input */
+        m->size = !fstat(m->fd, &st) && st.st_size < m->size ? FFMAX(st.st_size, 0) : m->pos;
+        err("input truncated to %lld bytes while mapped", (long long) m->size);
+        return AVERROR(EIO);
+    }
+    mmap_fault_armed = 1;
+    atomic_signal_fence(memory_order_seq_cst);
+    memcpy(buf, m->data + m->pos, n);
+    atomic_signal_fence(memory_order_seq_cst);
+    mmap_fault_armed = 0;
+    m->pos += n;
+    m->reads++;
+
+    return n;
+}
+
+/* seeking is a pointer move, the readahead restarts when leaving its window */
+static int64_t mmap_input_seek(void *opaque, int64_t offset, int whence)
+{
+    struct mmap_input *m = opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return m->size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += m->pos;
+        break;
+    case SEEK_END:
+        offset += m->size;
+        break;
+    default:
+        return AVERROR(EINVAL);
     }
-    return;
+
+    if (offset < 0 || offset > m->size)
+        return AVERROR(EINVAL);
+
+    if (offset != m->pos)
+        m->seeks++;
+    if (offset > m->readahead_end || offset < m->readahead_end - m->window)
+        m->readahead_end = offset;
+    m->pos = offset;
+
+    return offset;
 }
 
-static int find_plane(int fd, unsigned int fourcc, uint32_t * plane_id, uint32_t crtc_id, uint32_t crtc_idx)
+static void mmap_input_close(struct mmap_input *m)
 {
-    drmModePlaneResPtr planes;
-    drmModePlanePtr plane;
-    unsigned int i;
-    unsigned int j;
-    int ret = 0;
-    unsigned int format = fourcc;
-    char fmtStringObtained[16] = { 0 };
+    if (!m)
+        return;
+
+    if (m->avio) {
+        av_freep(&m->avio->buffer);
+        avio_context_free(&m->avio);
+    }
+    if (m->data)
+        munmap(m->data, m->map_size);
+    if (m->fd >= 0)
+        close(m->fd);
+    free(m);
+}
 
+/* NULL when the url is not a regular local file or cannot be mapped */
+static struct mmap_input *mmap_input_open(const char *url)
+{
+    struct mmap_input *m;
+    struct stat st;
+    uint8_t *buffer;
 
-    planes = drmModeGetPlaneResources(fd);
-    if (!planes) {
-        err("drmModeGetPlaneResources failed\n");
+    if (!strncmp(url, "file:", 5))
+        url += 5;
+    else if (strstr(url, "://"))
+        return NULL;
+
+    m = calloc(1, sizeof(*m));
+    if (!m)
+        return NULL;
+    m->fd = open(url, O_RDONLY | O_CLOEXEC);
+    if (m->fd < 0 || fstat(m->fd, &st) || !S_ISREG(st.st_mode) || !st.st_size ||
+        (uint64_t) st.st_size > SIZE_MAX)
+        goto fail;
+
+    /* may not fit in a 32-bit address space, the default path is used then */
+    m->size = m->map_size = st.st_size;
+    m->data = mmap(NULL, m->size, PROT_READ, MAP_SHARED, m->fd, 0);
+    if (m->data == MAP_FAILED) {
+        m->data = NULL;
+        goto fail;
+    }
+    madvise(m->data, m->size, MADV_SEQUENTIAL);
+    posix_fadvise(m->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    pthread_once(&mmap_fault_once, mmap_fault_install);
+    m->window = MMAP_READAHEAD_MIN;
+
+    buffer = av_malloc(MMAP_IO_BUFFER);
+    if (!buffer)
+        goto fail;
+    m->avio = avio_alloc_context(buffer, MMAP_IO_BUFFER, 0, m, mmap_input_read, NULL, mmap_input_seek);
+    if (!m->avio) {
+        av_free(buffer);
+        goto fail;
+    }
+
+    return m;
+
+  fail:
+    mmap_input_close(m);
+    return NULL;
+}
+
+/* readahead covers a few seconds of the stream once its bitrate is known */
+static void mmap_input_set_bitrate(struct mmap_input *m, int64_t bit_rate)
+{
+    if (bit_rate <= 0)
+        return;
+
+    m->window = av_clip64(bit_rate / 8 * MMAP_READAHEAD_SECONDS, MMAP_READAHEAD_MIN, MMAP_READAHEAD_MAX);
+    posix_fadvise(m->fd, m->pos, m->window, POSIX_FADV_WILLNEED);
+    m->readahead_end = FFMIN(m->pos + m->window, m->size);
+}
+
+static int pipeline_interrupt(void *opaque)
+{
+    struct pipeline *p = opaque;
+
+    return atomic_load(&p->abort);
+}
+
+/* --codec, or the decoder of the requested backend for this codec */
+static const AVCodec *find_decoder(enum AVCodecID id, const struct player_config *cfg)
+{
+    const AVCodec *codec;
+    void *it = NULL;
+    char name[64];
+
+    if (cfg->codec_name)
+        return avcodec_find_decoder_by_name(cfg->codec_name);
+    if (!cfg->backend || !strcmp(cfg->backend, "auto"))
+        return avcodec_find_decoder(id);
+
+    if (!strcmp(cfg->backend, "software")) {
+        while ((codec = av_codec_iterate(&it)))
+            if (av_codec_is_decoder(codec) && codec->id == id && !(codec->capabilities & AV_CODEC_CAP_HARDWARE))
+                return codec;
+        return NULL;
+    }
+
+    snprintf(name, sizeof(name), "%s_%s", avcodec_get_name(id), cfg->backend);
+    return avcodec_find_decoder_by_name(name);
+}
+
+static struct pipeline *pipeline_alloc(const char *url)
+{
+    struct pipeline *p = calloc(1, sizeof(*p));
+
+    if (!p)
+        return NULL;
+
+    p->url = strdup(url);
+    if (!p->url) {
+        free(p);
+        return NULL;
+    }
+    atomic_init(&p->state, PIPELINE_LOADING);
+    atomic_init(&p->abort, 0);
+
+    return p;
+}
+
+static int pipeline_open_subtitles(struct pipeline *p)
+{
+    const AVCodec *codec;
+    AVStream *st;
+    int ret;
+
+    ret = av_find_best_stream(p->input_ctx, AVMEDIA_TYPE_SUBTITLE, -1, p->video_stream, &codec, 0);
+    if (ret < 0)
+        return ret;
+    st = p->input_ctx->streams[ret];
+
+    p->sub_ctx = avcodec_alloc_context3(codec);
+    if (!p->sub_ctx)
+        return AVERROR(ENOMEM);
+
+    if (avcodec_parameters_to_context(p->sub_ctx, st->codecpar) < 0) {
+        avcodec_free_context(&p->sub_ctx);
         return -1;
     }
+    p->sub_ctx->pkt_timebase = st->time_base;
 
-    // dbg("found planes %u", planes->count_planes);
+    if (avcodec_open2(p->sub_ctx, codec, NULL) < 0) {
+        avcodec_free_context(&p->sub_ctx);
+        return -1;
+    }
+    p->sub_stream = ret;
 
-    for (i = 0; i < planes->count_planes; ++i) {
-        plane = drmModeGetPlane(fd, planes->planes[i]);
-        if (!plane) {
-            err("drmModeGetPlane failed: %s\n", strerror(errno));
-            break;
-        }
+    return 0;
+}
 
-        if (!(plane->possible_crtcs & (1 << crtc_idx))) {
-            drmModeFreePlane(plane);
-            continue;
-        }
+/* open input and decoder with the probing and pool settings of the profile */
+static int pipeline_open(struct pipeline *p, const struct player_config *cfg)
+{
+    const struct input_profile *profile = cfg->profile;
+    int64_t probesize = cfg->probesize, analyzeduration = cfg->analyzeduration;
+    int capture_buffers = cfg->capture_buffers, threads = cfg->threads;
+    AVDictionary *opts = NULL;
+    AVCodecParameters *codecpar;
+    const AVCodec *codec;
+    AVStream *video;
+    int ret;
 
-        for (j = 0; j < plane->count_formats; ++j) {
-            // fcc2s(fmtStringObtained, 8, plane->formats[j]);
-            // print("Pixel format plane[%d]: %s (%#x)\n", j, fmtStringObtained, plane->formats[j]);
-            if (plane->formats[j] == format)
-                break;
-        }
+    p->input_ctx = avformat_alloc_context();
+    if (!p->input_ctx) {
+        err("Cannot allocate input format (Out of memory?)\n");
+        return AVERROR(ENOMEM);
+    }
+    p->input_ctx->interrupt_callback.callback = pipeline_interrupt;
+    p->input_ctx->interrupt_callback.opaque = p;
 
-        if (j == plane->count_formats) {
-            drmModeFreePlane(plane);
-            continue;
-        }
+    // Enable non-blocking mode
+    if (cfg->v4l2) {
+        p->input_ctx->flags |= AVFMT_FLAG_NONBLOCK;
+        //
+        // av_dict_set(&opts, "loglevel", "debug", 0);
+        //
+        av_dict_set(&opts, "input_format", cfg->pixel_format, 0);
+        av_dict_set(&opts, "video_size", cfg->size_window, 0);
+    }
 
-        *plane_id = plane->plane_id;
-        drmModeFreePlane(plane);
-        break;
+    /* local files can be read from a mapping instead of read() calls */
+    if (cfg->mmap_io && !cfg->v4l2 && !cfg->ifmt) {
+        p->mmap = mmap_input_open(p->url);
+        if (p->mmap)
+            p->input_ctx->pb = p->mmap->avio;
+        else
+            dbg("no mmap I/O for '%s', using the default path", p->url);
     }
 
-    if (i == planes->count_planes)
-        ret = -1;
+    /* an explicit probe size also bounds the container detection */
+    if (probesize > 0)
+        av_dict_set_int(&opts, "probesize", probesize, 0);
 
-    drmModeFreePlaneResources(planes);
+    /* open the input file */
+    if (avformat_open_input(&p->input_ctx, p->url, cfg->ifmt, &opts) != 0) {
+        fprintf(stderr, "Cannot open input file '%s'\n", p->url);
+        av_dict_free(&opts);
+        return -1;
+    }
+    av_dict_free(&opts);
+    if (!p->background)
+        timing_mark(open);
+
+    /* probing: explicit option, then profile, then the container class */
+    if (probesize < 0)
+        probesize = profile->probesize;
+    if (analyzeduration < 0)
+        analyzeduration = profile->analyzeduration;
+    if (is_raw_demuxer(p->input_ctx->iformat)) {
+        if (probesize == PROFILE_AUTO)
+            probesize = 512 * 1024;
+        if (analyzeduration == PROFILE_AUTO)
+            analyzeduration = 200000;
+    }
+    if (probesize > 0)
+        p->input_ctx->probesize = probesize;
+    if (analyzeduration > 0)
+        p->input_ctx->max_analyze_duration = analyzeduration;
 
-    return ret;
+    if (avformat_find_stream_info(p->input_ctx, NULL) < 0) {
+        fprintf(stderr, "Cannot find input stream information.\n");
+        return -1;
+    }
+    if (!p->background)
+        timing_mark(probe);
+    if (p->mmap)
+        mmap_input_set_bitrate(p->mmap, p->input_ctx->bit_rate);
+
+    /* find the video stream information */
+    ret = av_find_best_stream(p->input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Cannot find a video stream in the input file\n");
+        return -1;
+    }
+    p->video_stream = ret;
+
+    /* find the video decoder: ie: h264_rkmpp */
+    video = p->input_ctx->streams[p->video_stream];
+    codecpar = video->codecpar;
+    codec = find_decoder(codecpar->codec_id, cfg);
+    if (!codec) {
+        err("Codec not found\n");
+        return -1;
+    }
+
+    if (video->avg_frame_rate.num && video->avg_frame_rate.den)
+        p->fps = av_q2d(video->avg_frame_rate);
+
+    /* decoder pool: explicit option, then profile, then codec/resolution */
+    if (capture_buffers < 0)
+        capture_buffers = profile->capture_buffers;
+    if (capture_buffers == PROFILE_AUTO)
+        capture_buffers = profile_capture_buffers(codecpar);
+    capture_buffers = mem_fit_buffers(capture_buffers, profile_min_buffers(codecpar), mem_frame_size(codecpar),
+                                      p->mem_available);
+    if (capture_buffers > 0) {
+        p->capture_buffers = capture_buffers;
+        p->pool_bytes = capture_buffers * mem_frame_size(codecpar);
+    }
+    if (threads < 0)
+        threads = profile->threads;
+    if (threads == PROFILE_AUTO)
+        threads = profile_threads(codec);
+    if (threads > 0)
+        p->threads = threads;
+
+    dbg("profile %s: %s %dx%d, probesize %lld, analyzeduration %lld, buffers %d, threads %d",
+        profile->name, p->input_ctx->iformat->name, codecpar->width, codecpar->height,
+        (long long) p->input_ctx->probesize, (long long) p->input_ctx->max_analyze_duration,
+        capture_buffers, p->threads);
+
+    ret = pipeline_open_decoder(p, codec, cfg);
+    if (ret < 0)
+        return ret;
+    if (!p->background)
+        timing_mark(codec_open);
+
+    /* subtitles only go to the OSD plane */
+    p->sub_stream = -1;
+    if (osd_plane_id && pipeline_open_subtitles(p) < 0)
+        dbg("no usable subtitle stream in '%s'", p->url);
+
+    p->frame = av_frame_alloc();
+    p->preroll = av_frame_alloc();
+    if (!p->frame || !p->preroll) {
+        err("Could not allocate video frame\n");
+        return AVERROR(ENOMEM);
+    }
+
+    return 0;
 }
 
-static struct drm_dev *drm_find_dev(int fd)
+/* decode up to the first picture and keep it for the switch */
+static int pipeline_preroll(struct pipeline *p)
 {
-    int i;
-    struct drm_dev *dev = NULL, *dev_head = NULL;
-    drmModeRes *res;
-    drmModeConnector *conn;
-    drmModeEncoder *enc;
-    drmModeCrtc *crtc = NULL;
+    AVPacket pkt;
+    int ret;
 
-    if ((res = drmModeGetResources(fd)) == NULL) {
-        err("drmModeGetResources() failed");
+    for (;;) {
+        if (atomic_load(&p->abort))
+            return AVERROR_EXIT;
+
+        /* after EAGAIN here, send_packet is guaranteed to accept a packet */
+        ret = avcodec_receive_frame(p->codec_ctx, p->preroll);
+        if (ret != AVERROR(EAGAIN))
+            return ret;
+
+        ret = av_read_frame(p->input_ctx, &pkt);
+        if (ret == AVERROR(EAGAIN)) {
+            usleep(1000);
+            continue;
+        }
+        if (ret < 0)
+            return ret;
+
+        if (pkt.stream_index == p->video_stream)
+            ret = avcodec_send_packet(p->codec_ctx, &pkt);
+        av_packet_unref(&pkt);
+        if (ret < 0)
+            return ret;
+    }
+}
+
+static void *pipeline_preroll_thread(void *arg)
+{
+    struct pipeline *p = arg;
+    int64_t start = monotonic_us();
+    int ret;
+
+    ret = pipeline_open(p, &config);
+    if (!ret)
+        ret = pipeline_preroll(p);
+
+    if (ret < 0) {
+        if (ret != AVERROR_EXIT)
+            err("standby '%s' failed: %s", p->url, av_err2str(ret));
+        atomic_store(&p->state, PIPELINE_FAILED);
         return NULL;
     }
 
-    if (res->count_crtcs <= 0) {
-        err("no Crtcs");
-        goto free_res;
+    dbg("standby '%s' pre-rolled in %lld us", p->url, (long long) (monotonic_us() - start));
+    atomic_store(&p->state, PIPELINE_READY);
+
+    return NULL;
+}
+
+static void pipeline_free(struct pipeline *p)
+{
+    if (p->background)
+        pthread_join(p->thread, NULL);
+
+    avformat_close_input(&p->input_ctx);
+    if (p->mmap)
+        dbg("mmap I/O '%s': %u reads, %u seeks, readahead %lld KiB", p->url, p->mmap->reads,
+            p->mmap->seeks, (long long) (p->mmap->window >> 10));
+    mmap_input_close(p->mmap);
+    avcodec_free_context(&p->codec_ctx);
+    avcodec_free_context(&p->sub_ctx);
+    av_frame_free(&p->frame);
+    av_frame_free(&p->preroll);
+    free(p->url);
+    free(p);
+}
+
+static void *pipeline_free_thread(void *arg)
+{
+    pipeline_free(arg);
+
+    return NULL;
+}
+
+/* closing a decoder can take a while (buffer release): keep it off the display path */
+static void pipeline_release(struct pipeline *p)
+{
+    pthread_t thread;
+
+    if (!p)
+        return;
+
+    atomic_store(&p->abort, 1);
+    if (p->accounted)
+        mem_add(&mem.pool, &mem.pool_peak, -p->pool_bytes);
+
+    if (rt_thread_create(&thread, pipeline_free_thread, p)) {
+        pipeline_free(p);
+        return;
     }
+    pthread_detach(thread);
+}
 
-    /* find all available connectors */
-    for (i = 0; i < res->count_connectors; i++) {
-        conn = drmModeGetConnector(fd, res->connectors[i]);
+static int pipeline_load(const char *url)
+{
+    struct pipeline *p;
 
-        if (conn) {
-            if (conn->connection == DRM_MODE_CONNECTED) {
-                dbg("connector: connected");
-            } else if (conn->connection == DRM_MODE_DISCONNECTED) {
-                dbg("connector: disconnected");
-            } else if (conn->connection == DRM_MODE_UNKNOWNCONNECTION) {
-                dbg("connector: unknownconnection");
-            } else {
-                dbg("connector: unknown");
-            }
-        }
+    pipeline_release(standby);
+    standby = NULL;
 
-        if (conn != NULL && conn->connection == DRM_MODE_CONNECTED && conn->count_modes > 0) {
-            dev = (struct drm_dev *) malloc(sizeof(struct drm_dev));
-            memset(dev, 0, sizeof(struct drm_dev));
+    p = pipeline_alloc(url);
+    if (!p)
+        return AVERROR(ENOMEM);
 
-            dev->conn_id = conn->connector_id;
-            dev->enc_id = conn->encoder_id;
-            dev->next = NULL;
+    p->background = 1;
+    p->mem_available = mem_available();
+    if (rt_thread_create(&p->thread, pipeline_preroll_thread, p)) {
+        p->background = 0;
+        pipeline_free(p);
+        return AVERROR(errno);
+    }
+    standby = p;
 
-            memcpy(&dev->mode, &conn->modes[0], sizeof(drmModeModeInfo));
-            dev->width = conn->modes[0].hdisplay;
-            dev->height = conn->modes[0].vdisplay;
+    return 0;
+}
 
-            if (conn->encoder_id) {
-                enc = drmModeGetEncoder(fd, conn->encoder_id);
-                if (!enc) {
-                    err("drmModeGetEncoder() failed");
-                    goto free_res;
-                }
-                if (enc->crtc_id) {
-                    crtc = drmModeGetCrtc(fd, enc->crtc_id);
-                    if (crtc) {
-                        dev->crtc_id = enc->crtc_id;
-                        drmModeFreeCrtc(crtc);
-                    }
-                }
-                drmModeFreeEncoder(enc);
-            }
+/* show the pre-rolled picture in one commit, then retire the old pipeline */
+/* the standby's pictures must fit the plane the active one was shown on */
+static int pipeline_switch_check(struct pipeline *p)
+{
+    unsigned int fourcc = frame_fourcc(p->preroll);
+    char fmt[16] = { 0 };
+
+    if (null_display)
+        return 0;
+    if (share.fd >= 0) {
+        if (p->preroll->format == AV_PIX_FMT_DRM_PRIME)
+            return 0;
+        err("switch cancelled: '%s' has no DRM PRIME output", p->url);
+        return -1;
+    }
+    if (!pdev || fourcc == drm_format)
+        return 0;
 
-            dev->saved_crtc = NULL;
+    fcc2s(fmt, 8, fourcc);
+    if (!plane_has_format(pdev->fd, pdev->plane_id, fourcc)) {
+        err("switch cancelled: plane %u has no %s for '%s'", pdev->plane_id, fmt, p->url);
+        return -1;
+    }
+    drm_format = fourcc;
 
-            /* create dev list */
-            dev->next = dev_head;
-            dev_head = dev;
-        }
-        drmModeFreeConnector(conn);
+    return 0;
+}
+
+static int pipeline_switch(void)
+{
+    struct pipeline *old = active;
+    int64_t start = monotonic_us();
+    int ret;
+
+    /* the active pipeline keeps playing */
+    if (pipeline_switch_check(standby)) {
+        pipeline_release(standby);
+        standby = NULL;
+        return -1;
     }
 
-    dev->crtc_idx = -1;
+    trick_gop_clear();
+    trick.rate = 1;
+    trick.last_pts = 0;
+    trick.skip_until = INT64_MIN;
+    trick.sought_pts = INT64_MIN;
+    trick.anchored = 0;
+    resync.failures = 0;
+    resync.waiting_key = 0;
+    resync.hide_since = 0;
+
+    active = standby;
+    standby = NULL;
+    paused = 0;
+    mem.capture_buffers = active->capture_buffers;
+    content_fps = active->fps;
+
+    ret = display_frame(active->preroll, config.device);
+    av_frame_unref(active->preroll);
+    pipeline_release(old);
+    if (ret < 0)
+        return ret;
 
-    for (i = 0; i < res->count_crtcs; ++i) {
-        if (dev->crtc_id == res->crtcs[i]) {
-            dev->crtc_idx = i;
-            break;
+    info("switched to '%s' in %lld us", active->url, (long long) (monotonic_us() - start));
+
+    return 0;
+}
+
+/* called from the playback loop: account a pre-rolled standby, run a pending switch */
+static void pipeline_poll(void)
+{
+    if (!standby)
+        return;
+
+    switch (atomic_load(&standby->state)) {
+    case PIPELINE_READY:
+        if (!standby->accounted) {
+            mem_add(&mem.pool, &mem.pool_peak, standby->pool_bytes);
+            standby->accounted = 1;
         }
+        if (switch_pending) {
+            switch_pending = 0;
+            pipeline_switch();
+        }
+        break;
+    case PIPELINE_FAILED:
+        if (switch_pending)
+            err("switch cancelled: standby failed");
+        switch_pending = 0;
+        pipeline_release(standby);
+        standby = NULL;
+        break;
     }
+}
 
-    if (dev->crtc_idx == -1)
-        err("drm: CRTC not found\n");
+/* ts in AV_TIME_BASE units, start time included */
+static int pipeline_seek(struct pipeline *p, int64_t ts)
+{
+    int ret;
 
-  free_res:
-    drmModeFreeResources(res);
+    ret = av_seek_frame(p->input_ctx, -1, ts, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0)
+        return ret;
 
-    return dev_head;
+    avcodec_flush_buffers(p->codec_ctx);
+
+    return 0;
 }
 
-static int drm_open(const char *path)
+/*
+ * Control socket: one client at a time, one command per line
+ *      load <url>      open and pre-roll <url> in the standby pipeline
+ *      switch          show the standby as soon as it is pre-rolled
+ *      pause           toggle pause
+ *      seek <seconds>  seek the active pipeline
+ *      rate <n>        trick play at n times normal speed, negative is reverse
+ *      step            pause, then show one more frame per command
+ */
+static void control_unlink(void)
 {
-    int fd, flags;
-    uint64_t has_dumb;
-    int ret;
+    unlink(control.path);
+}
 
-    fd = open(path, O_RDWR);
-    if (fd < 0) {
-        err("cannot open \"%s\"\n", path);
+static int control_open(const char *path)
+{
+    struct sockaddr_un addr;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        err("control socket path too long: %s", path);
         return -1;
     }
+    strcpy(addr.sun_path, path);
 
-    /* set FD_CLOEXEC flag */
-    if ((flags = fcntl(fd, F_GETFD)) < 0 || fcntl(fd, F_SETFD, flags | FD_CLOEXEC) < 0) {
-        err("fcntl FD_CLOEXEC failed\n");
-        goto err;
+    control.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (control.listen_fd < 0) {
+        err("control socket: %s", strerror(errno));
+        return -1;
     }
 
-    /* check capability */
-    ret = drmGetCap(fd, DRM_CAP_DUMB_BUFFER, &has_dumb);
-    if (ret < 0 || has_dumb == 0) {
-        err("drmGetCap DRM_CAP_DUMB_BUFFER failed or doesn't have dumb " "buffer\n");
-        goto err;
+    unlink(path);
+    if (bind(control.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(control.listen_fd, 1) < 0) {
+        err("control socket %s: %s", path, strerror(errno));
+        close(control.listen_fd);
+        control.listen_fd = -1;
+        return -1;
     }
 
-    return fd;
-  err:
-    close(fd);
-    return -1;
+    control.path = path;
+    atexit(control_unlink);
+
+    return 0;
 }
 
-static int drm_init(unsigned int fourcc, const char *device)
+static void control_reply(const char *msg)
 {
-    struct drm_dev *dev_head, *dev;
-    drmModeAtomicReq *req;
-    int fd;
-    int ret;
+    if (control.client_fd >= 0 && send(control.client_fd, msg, strlen(msg), MSG_NOSIGNAL) < 0)
+        err("control reply: %s", strerror(errno));
+}
 
-    fd = drm_open(device);
-    if (fd < 0)
-        return -1;
+static void control_command(char *line)
+{
+    char *arg = strchr(line, ' ');
 
-    ret = drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
-    if (ret) {
-        err("No atomic modesetting support: %s\n", strerror(errno));
-        goto err;
+    if (arg) {
+        *arg++ = '\0';
+        while (*arg == ' ')
+            arg++;
     }
 
-    req = drmModeAtomicAlloc();
+    if (!strcmp(line, "load") && arg && *arg) {
+        control_reply(pipeline_load(arg) ? "error: load failed\n" : "ok\n");
+    } else if (!strcmp(line, "switch")) {
+        if (!standby) {
+            control_reply("error: nothing loaded\n");
+            return;
+        }
+        switch_pending = 1;
+        control_reply(atomic_load(&standby->state) == PIPELINE_READY ? "ok\n" : "ok pending\n");
+    } else if (!strcmp(line, "pause")) {
+        paused = !paused;
+        trick.anchored = 0;
+        control_reply(paused ? "ok paused\n" : "ok playing\n");
+    } else if (!strcmp(line, "seek") && arg && *arg) {
+        int64_t ts = pipeline_start_time(active) + atof(arg) * AV_TIME_BASE;
+
+        trick_gop_clear();
+        trick.last_pts = trick.segment_end = trick.skip_until = ts;
+        trick.sought_pts = INT64_MIN;
+        trick.anchored = 0;
+        control_reply(pipeline_seek(active, ts) ? "error: seek failed\n" : "ok\n");
+    } else if (!strcmp(line, "rate") && arg && *arg) {
+        control_reply(trick_set_rate(atoi(arg)) ? "error: rate failed\n" : "ok\n");
+    } else if (!strcmp(line, "step")) {
+        if (!paused)
+            paused = 1;
+        else
+            step_frames++;
+        control_reply("ok\n");
+    } else {
+        control_reply("error: unknown command\n");
+    }
+}
 
-    dev_head = drm_find_dev(fd);
-    if (dev_head == NULL) {
-        err("available drm devices not found\n");
-        goto err;
+/* never blocks longer than timeout_ms: the playback loop calls it between packets */
+static void control_poll(int timeout_ms)
+{
+    struct pollfd fds[2];
+    char *line, *end;
+    ssize_t n;
+    int nfds = 0;
+
+    if (control.listen_fd < 0) {
+        if (timeout_ms > 0)
+            usleep(timeout_ms * 1000);
+        return;
     }
 
-    dbg("available connector(s)");
+    fds[nfds].fd = control.listen_fd;
+    fds[nfds++].events = POLLIN;
+    if (control.client_fd >= 0) {
+        fds[nfds].fd = control.client_fd;
+        fds[nfds++].events = POLLIN;
+    }
 
-    for (dev = dev_head; dev != NULL; dev = dev->next) {
-        dbg("connector id:%d", dev->conn_id);
-        dbg("\tencoder id:%d crtc id:%d", dev->enc_id, dev->crtc_id);
-        dbg("\twidth:%d height:%d", dev->width, dev->height);
+    if (poll(fds, nfds, timeout_ms) <= 0)
+        return;
+
+    if (fds[0].revents & POLLIN) {
+        int fd = accept(control.listen_fd, NULL, NULL);
+
+        if (fd >= 0) {
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+            if (control.client_fd >= 0)
+                close(control.client_fd);
+            control.client_fd = fd;
+            control.len = 0;
+            return;
+        }
     }
 
-    /* FIXME: use first drm_dev */
-    dev = dev_head;
-    dev->fd = fd;
-    dev->req = req;
-    pdev = dev;
+    if (nfds < 2 || !fds[1].revents)
+        return;
 
-    ret = find_plane(fd, fourcc, &dev->plane_id, dev->crtc_id, dev->crtc_idx);
-    if (ret) {
-        err("Cannot find plane: %c%c%c%c", (fourcc >> 0) & 0xff, (fourcc >> 8) & 0xff, (fourcc >> 16) & 0xff, (fourcc >> 24) & 0xff);
-        goto err;
+    n = read(control.client_fd, control.buf + control.len, sizeof(control.buf) - 1 - control.len);
+    if (n <= 0) {
+        if (n == 0 || errno != EAGAIN) {
+            close(control.client_fd);
+            control.client_fd = -1;
+        }
+        return;
+    }
+    control.len += n;
+    control.buf[control.len] = '\0';
+
+    line = control.buf;
+    while ((end = strchr(line, '\n'))) {
+        *end = '\0';
+        if (end > line && end[-1] == '\r')
+            end[-1] = '\0';
+        control_command(line);
+        line = end + 1;
     }
 
-    ret = drm_get_plane_props(fd, dev->plane_id);
-    pdev->drm_event_ctx.version = DRM_EVENT_CONTEXT_VERSION;
-    pdev->drm_event_ctx.page_flip_handler = page_flip_handler;
+    /* keep a partial line, drop one that can never fit */
+    control.len = strlen(line);
+    if (control.len == sizeof(control.buf) - 1)
+        control.len = 0;
+    memmove(control.buf, line, control.len);
+}
 
-    dbg("\tFound %c%c%c%c plane_id: %u\n", (fourcc >> 0) & 0xff, (fourcc >> 8) & 0xff, (fourcc >> 16) & 0xff, (fourcc >> 24) & 0xff, dev->plane_id);
+/*
+ * Benchmark: synthetic streams are encoded once with libavcodec into
+ * <dir>/<codec>-<W>x<H>-<depth>bit.mkv, then each one goes through the
+ * normal pipeline (--backend, --display) and one table row is printed.
+ */
+struct bench_stream {
+    enum AVCodecID codec_id;
+    int width, height, depth;
+};
 
-    return 0;
+static const struct bench_stream bench_default[] = {
+    { AV_CODEC_ID_H264, 1280,  720, 8 },
+    { AV_CODEC_ID_H264, 1920, 1080, 8 },
+    { AV_CODEC_ID_HEVC, 1920, 1080, 8 },
+    { AV_CODEC_ID_HEVC, 1920, 1080, 10 },
+    { AV_CODEC_ID_HEVC, 3840, 2160, 10 },
+    { AV_CODEC_ID_AV1,  1920, 1080, 8 },
+    { AV_CODEC_ID_AV1,  1920, 1080, 10 },
+};
 
-  err:
-    close(fd);
-    pdev = NULL;
-    return -1;
+/* "all", or "h264:1920x1080:8,hevc:3840x2160:10" */
+static int bench_parse(const char *list, struct bench_stream *streams)
+{
+    const AVCodecDescriptor *desc;
+    char name[32];
+    int n = 0, len;
+
+    if (!strcmp(list, "all")) {
+        memcpy(streams, bench_default, sizeof(bench_default));
+        return FF_ARRAY_ELEMS(bench_default);
+    }
+
+    while (*list && n < BENCH_MAX_STREAMS) {
+        streams[n].depth = 8;
+        if (sscanf(list, "%31[^:]:%dx%d%n", name, &streams[n].width, &streams[n].height, &len) < 3)
+            return -1;
+        list += len;
+        if (*list == ':')
+            streams[n].depth = strtol(list + 1, (char **) &list, 10);
+        desc = avcodec_descriptor_get_by_name(name);
+        if (!desc || streams[n].width <= 0 || streams[n].height <= 0 ||
+            (streams[n].depth != 8 && streams[n].depth != 10))
+            return -1;
+        streams[n++].codec_id = desc->id;
+        if (*list == ',')
+            list++;
+        else if (*list)
+            return -1;
+    }
+
+    return n;
 }
 
-static void drm_remove_fb(struct drm_buffer *drm_buf)
+/* a software encoder taking planar 4:2:0 at this depth */
+static const AVCodec *bench_find_encoder(enum AVCodecID id, enum AVPixelFormat format)
 {
-    struct drm_gem_close gem_close;
-    int i;
+    const AVCodec *codec;
+    const enum AVPixelFormat *p;
+    void *it = NULL;
 
-    if (drmModeRmFB(pdev->fd, drm_buf->fb_handle))
-        err("cant remove fb %d\n", drm_buf->fb_handle);
+    while ((codec = av_codec_iterate(&it))) {
+        if (!av_codec_is_encoder(codec) || codec->id != id || (codec->capabilities & AV_CODEC_CAP_HARDWARE))
+            continue;
+        for (p = codec->pix_fmts; p && *p != AV_PIX_FMT_NONE; p++)
+            if (*p == format)
+                return codec;
+    }
 
-    for (i = 0; i < AV_DRM_MAX_PLANES; i++) {
-        if (drm_buf->bo_handles[i]) {
-            memset(&gem_close, 0, sizeof gem_close);
-            gem_close.handle = drm_buf->bo_handles[i];
-            if (drmIoctl(pdev->fd, DRM_IOCTL_GEM_CLOSE, &gem_close) < 0)
-                err("cant close gem: %s\n", strerror(errno));
+    return NULL;
+}
+
+/* gradient scrolling by 2 pixels per frame with a moving box: every frame differs */
+static void bench_fill(AVFrame * frame, int n, int depth)
+{
+    int plane, x, y, w, h, v, bx, by, size = frame->height / 8;
+
+    bx = (n * 7) % (frame->width - size);
+    by = (n * 3) % (frame->height - size);
+    for (plane = 0; plane < 3; plane++) {
+        w = plane ? (frame->width + 1) >> 1 : frame->width;
+        h = plane ? (frame->height + 1) >> 1 : frame->height;
+        for (y = 0; y < h; y++) {
+            uint8_t *row = frame->data[plane] + (ptrdiff_t) y * frame->linesize[plane];
+
+            for (x = 0; x < w; x++) {
+                if (plane)
+                    v = 96 + ((x + y + n) & 63);
+                else if (x >= bx && x < bx + size && y >= by && y < by + size)
+                    v = 235;
+                else
+                    v = 16 + ((x + 2 * n) & 127) + ((y >> 3) & 63);
+                if (depth > 8)
+                    ((uint16_t *) row)[x] = v << (depth - 8);
+                else
+                    row[x] = v;
+            }
         }
     }
-    free(drm_buf);
 }
 
-static int display(struct drm_buffer *drm_buf, int width, int height, AVRational sar)
+static int bench_generate(const struct bench_stream *s, const char *path)
 {
-    int ret;
+    enum AVPixelFormat format = s->depth > 8 ? AV_PIX_FMT_YUV420P10 : AV_PIX_FMT_YUV420P;
+    const AVCodec *codec = bench_find_encoder(s->codec_id, format);
+    AVCodecContext *enc = NULL;
+    AVFormatContext *oc = NULL;
+    AVFrame *frame = NULL;
+    AVPacket *pkt = NULL;
+    AVStream *st;
+    char tmp[PATH_MAX];
+    int i, ret;
 
-    ret = drm_dmabuf_addfb(drm_buf, width, height);
-    if (ret) {
-        err("cannot add framebuffer %d\n", ret);
-        return -EFAULT;
+    if (!codec) {
+        err("no %d-bit %s encoder", s->depth, avcodec_get_name(s->codec_id));
+        return AVERROR_ENCODER_NOT_FOUND;
     }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    info("generating %s with %s", path, codec->name);
 
-    drm_dmabuf_set_plane(drm_buf, width, height, 1, sar);
+    enc = avcodec_alloc_context3(codec);
+    frame = av_frame_alloc();
+    pkt = av_packet_alloc();
+    if (!enc || !frame || !pkt) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
 
-    if (pdev->bufs[1])
-        drm_remove_fb(pdev->bufs[1]);
+    enc->width = s->width;
+    enc->height = s->height;
+    enc->pix_fmt = format;
+    enc->time_base = (AVRational) { 1, BENCH_FPS };
+    enc->framerate = (AVRational) { BENCH_FPS, 1 };
+    enc->gop_size = BENCH_FPS;
+    enc->max_b_frames = 2;
+    enc->bit_rate = (int64_t) s->width * s->height * BENCH_FPS / 10;
+    /* fastest settings of x264/x265, SVT-AV1 and libaom; unknown ones are ignored */
+    if (av_opt_set(enc->priv_data, "preset", "ultrafast", 0) < 0)
+        av_opt_set(enc->priv_data, "preset", "12", 0);
+    av_opt_set(enc->priv_data, "cpu-used", "8", 0);
+
+    ret = avformat_alloc_output_context2(&oc, NULL, "matroska", tmp);
+    if (ret < 0)
+        goto end;
+    if (oc->oformat->flags & AVFMT_GLOBALHEADER)
+        enc->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    ret = avcodec_open2(enc, codec, NULL);
+    if (ret < 0)
+        goto end;
+
+    st = avformat_new_stream(oc, NULL);
+    if (!st) {
+        ret = AVERROR(ENOMEM);
+        goto end;
+    }
+    st->time_base = enc->time_base;
+    ret = avcodec_parameters_from_context(st->codecpar, enc);
+    if (ret < 0)
+        goto end;
+    ret = avio_open(&oc->pb, tmp, AVIO_FLAG_WRITE);
+    if (ret < 0)
+        goto end;
+    ret = avformat_write_header(oc, NULL);
+    if (ret < 0)
+        goto end;
+
+    frame->format = format;
+    frame->width = s->width;
+    frame->height = s->height;
+    ret = av_frame_get_buffer(frame, 0);
+    if (ret < 0)
+        goto end;
+
+    for (i = 0; i <= BENCH_FRAMES; i++) {
+        if (i < BENCH_FRAMES) {
+            ret = av_frame_make_writable(frame);
+            if (ret < 0)
+                goto end;
+            bench_fill(frame, i, s->depth);
+            frame->pts = i;
+        }
+        ret = avcodec_send_frame(enc, i < BENCH_FRAMES ? frame : NULL);
+        if (ret < 0)
+            goto end;
+        while ((ret = avcodec_receive_packet(enc, pkt)) >= 0) {
+            av_packet_rescale_ts(pkt, enc->time_base, st->time_base);
+            pkt->stream_index = st->index;
+            ret = av_interleaved_write_frame(oc, pkt);
+            if (ret < 0)
+                goto end;
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            goto end;
+    }
+    ret = av_write_trailer(oc);
 
-    pdev->bufs[1] = pdev->bufs[0];
-    pdev->bufs[0] = drm_buf;
+  end:
+    if (oc) {
+        avio_closep(&oc->pb);
+        avformat_free_context(oc);
+    }
+    avcodec_free_context(&enc);
+    av_frame_free(&frame);
+    av_packet_free(&pkt);
 
-    return 0;
+    if (ret < 0) {
+        err("cannot generate %s: %s", path, av_err2str(ret));
+        unlink(tmp);
+        return ret;
+    }
+
+    return rename(tmp, path) ? AVERROR(errno) : 0;
 }
 
+/* peak resident set since the last reset, KiB */
+static long bench_peak_rss(int reset)
+{
+    char line[128];
+    long kib = 0;
+    FILE *f;
+
+    if (reset) {
+        f = fopen("/proc/self/clear_refs", "w");
+        if (f) {
+            fputs("5", f);
+            fclose(f);
+        }
+        return 0;
+    }
 
-static int decode_and_display(AVCodecContext * dec_ctx, AVFrame * frame, AVPacket * pkt, const char *device)
+    f = fopen("/proc/self/status", "r");
+    if (!f)
+        return 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "VmHWM: %ld kB", &kib) == 1)
+            break;
+    fclose(f);
+
+    return kib;
+}
+
+static int64_t bench_cpu_us(void)
 {
-    AVDRMFrameDescriptor *desc;
-    AVDRMLayerDescriptor *layer;
-    struct drm_buffer *drm_buf = NULL;
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage))
+        return 0;
+
+    return (int64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 +
+        usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+/* one stream through demux, decode and present: as fast as the decoder, or the display, allows */
+static int bench_run(const struct bench_stream *s, const char *path)
+{
+    uint64_t frames = atomic_load(&metrics->frames_presented);
+    int64_t wall, cpu;
+    AVPacket pkt;
     int ret;
-    char fmtStringObtained[16] = { 0 };
 
-    ret = avcodec_send_packet(dec_ctx, pkt);
-    if (ret < 0) {
-        err("Sending a packet for decoding!\n");
-        return ret;
-    }
-    ret = 0;
-    while (ret >= 0) {
-        ret = avcodec_receive_frame(dec_ctx, frame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            //if (ret == AVERROR(EAGAIN)) {
-            //    err("avcodec_receive_frame EAGAIN\n"); 
-            //}
-            //usleep(10000);
+    active = pipeline_alloc(path);
+    if (!active)
+        return AVERROR(ENOMEM);
+    ret = pipeline_open(active, &config);
+    if (ret < 0)
+        goto end;
+    active->accounted = 1;
+    mem.capture_buffers = active->capture_buffers;
+    mem_add(&mem.pool, &mem.pool_peak, active->pool_bytes);
+    mem.peak = mem.pool + mem.dumb;
+    content_fps = active->fps;
+    trick.last_pts = 0;
+    trick.anchored = 0;
+    resync.failures = 0;
+    resync.waiting_key = 0;
+    resync.hide_since = 0;
+
+    bench_peak_rss(1);
+    cpu = bench_cpu_us();
+    wall = monotonic_us();
+
+    while ((ret = av_read_frame(active->input_ctx, &pkt)) >= 0 || ret == AVERROR(EAGAIN)) {
+        if (ret < 0)
+            continue;
+        if (pkt.stream_index == active->video_stream)
+            ret = decode_and_display(active->codec_ctx, active->frame, &pkt, config.device);
+        av_packet_unref(&pkt);
+        if (ret < 0)
             break;
-        }
-        else if (ret < 0) {
-            err("Error during decoding\n");
-            return ret;
-        }
+    }
+    if (ret == AVERROR_EOF)
+        ret = decode_and_display(active->codec_ctx, active->frame, NULL, config.device);
 
-        desc = (AVDRMFrameDescriptor *) frame->data[0];
-        layer = &desc->layers[0];
+    wall = monotonic_us() - wall;
+    cpu = bench_cpu_us() - cpu;
+    frames = atomic_load(&metrics->frames_presented) - frames;
 
-        if (!pdev) {
-            /* remember the format */
-            drm_format = layer->format;
-            if (drm_format == DRM_FORMAT_NV12_10)
-                drm_format = DRM_FORMAT_NV15;
+    /* the error policy keeps going without a picture on screen: that is a failed run */
+    if (!frames) {
+        ret = AVERROR(EIO);
+        goto end;
+    }
 
-            fcc2s(fmtStringObtained, 8, drm_format);
-            print("Pixel format avframe: %s (%#x)\n", fmtStringObtained, drm_format);
-            /* initialize DRM with the format returned in the frame */
-            ret = drm_init(drm_format, device);
-            if (ret) {
-                err("Initializing drm\n");
-                exit(1);
-            }
-        }
+    printf("%-5s %5dx%-5d %2d-bit  %-16s %6llu %9.1f %12.2f %10.1f %12.1f\n",
+           avcodec_get_name(s->codec_id), s->width, s->height, s->depth, active->codec_ctx->codec->name,
+           (unsigned long long) frames, frames * 1e6 / FFMAX(wall, 1), frames ? cpu / 1e3 / frames : 0.0,
+           bench_peak_rss(0) / 1024.0, mem.peak / 1048576.0);
+    fflush(stdout);
+
+  end:
+    alloc_report();
+    /* the next stream may need another format, and so another plane */
+    drm_deinit();
+    if (active->accounted)
+        mem_add(&mem.pool, &mem.pool_peak, -active->pool_bytes);
+    pipeline_free(active);
+    active = NULL;
+
+    return ret < 0 ? ret : 0;
+}
 
-        drm_buf = calloc(1, sizeof(*drm_buf));
-        // convert Prime FD to GEM handle
-        for (int i = 0; i < desc->nb_objects; i++) {
-            ret = drmPrimeFDToHandle(pdev->fd, desc->objects[i].fd, &drm_buf->bo_handles[i]);
-            if (ret < 0) {
-                err("Failed FDToHandle\n");
-                return ret;
-            }
-        }
+static int bench_main(const char *list, const char *dir)
+{
+    struct bench_stream streams[BENCH_MAX_STREAMS];
+    int generated[BENCH_MAX_STREAMS];
+    char path[PATH_MAX];
+    int i, n, failed = 0;
+
+    n = bench_parse(list, streams);
+    if (n <= 0) {
+        err("Invalid benchmark list '%s'\n", list);
+        return 1;
+    }
+    if (mkdir(dir, 0755) && errno != EEXIST) {
+        err("cannot create %s: %s", dir, strerror(errno));
+        return 1;
+    }
 
-        for (int i = 0; i < layer->nb_planes && i < AV_DRM_MAX_PLANES; i++) {
-            int object = layer->planes[i].object_index;
-            uint32_t handle = drm_buf->bo_handles[object];
-            if (handle && layer->planes[i].pitch) {
-                drm_buf->handles[i] = handle;
-                drm_buf->pitches[i] = layer->planes[i].pitch;
-                drm_buf->offsets[i] = layer->planes[i].offset;
-                drm_buf->modifiers[i] = desc->objects[object].format_modifier;
-            }
-        }
+    drm_buf_pool_init();
 
-        /* pass the format in the buffer */
-        drm_buf->fourcc = drm_format;
-        ret = display(drm_buf, frame->width, frame->height, frame->sample_aspect_ratio);
-        if (ret < 0) {
-            err("Display Failed!\n");
-            return ret;
+    /* generate first, so encoding does not disturb the measurements */
+    for (i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%s-%dx%d-%dbit.mkv", dir, avcodec_get_name(streams[i].codec_id),
+                 streams[i].width, streams[i].height, streams[i].depth);
+        generated[i] = !access(path, R_OK) || bench_generate(&streams[i], path) >= 0;
+    }
+
+    printf("%-5s %-11s %-7s %-16s %6s %9s %12s %10s %12s\n", "codec", "size", "depth", "decoder",
+           "frames", "fps", "cpu ms/frame", "rss MiB", "dma-buf MiB");
+    for (i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%s-%dx%d-%dbit.mkv", dir, avcodec_get_name(streams[i].codec_id),
+                 streams[i].width, streams[i].height, streams[i].depth);
+        if (!generated[i] || bench_run(&streams[i], path) < 0) {
+            printf("%-5s %5dx%-5d %2d-bit  failed\n", avcodec_get_name(streams[i].codec_id),
+                   streams[i].width, streams[i].height, streams[i].depth);
+            failed++;
         }
     }
-    return 0;
+
+    osd_free();
+    sw_free();
+
+    return failed ? 1 : 0;
 }
 
 static const struct option options[] = {
     {
-#define help_opt        0
-     .name = "help",
-     .has_arg = 0,
+#define help_opt        0
+     .name = "help",
+     .has_arg = 0,
+     .flag = NULL,
+      },
+    {
+#define video_opt       1
+     .name = "video",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define codec_opt       2
+     .name = "codec",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define height_opt      3
+     .name = "height",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define width_opt       4
+     .name = "width",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define device_opt      5
+     .name = "device",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define disable_plane_opt       6
+     .name = "disable-plane",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define v4l2_opt       7
+     .name = "v4l2",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define size_opt       8
+     .name = "size",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define pixel_opt       9
+     .name = "pixel",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define profile_opt     10
+     .name = "profile",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define probesize_opt   11
+     .name = "probesize",
+     .has_arg = 1,
      .flag = NULL,
       },
     {
-#define video_opt       1
-     .name = "video",
+#define analyzeduration_opt     12
+     .name = "analyzeduration",
      .has_arg = 1,
      .flag = NULL,
       },
     {
-#define codec_opt       2
-     .name = "codec",
+#define buffers_opt     13
+     .name = "buffers",
      .has_arg = 1,
      .flag = NULL,
       },
     {
-#define height_opt      3
-     .name = "height",
+#define threads_opt     14
+     .name = "threads",
      .has_arg = 1,
      .flag = NULL,
       },
     {
-#define width_opt       4
-     .name = "width",
+#define mem_budget_opt  15
+     .name = "mem-budget",
      .has_arg = 1,
      .flag = NULL,
       },
     {
-#define device_opt      5
-     .name = "device",
+#define mem_report_opt  16
+     .name = "mem-report",
      .has_arg = 1,
      .flag = NULL,
       },
     {
-#define disable_plane_opt       6
-     .name = "disable-plane",
+#define trace_opt       17
+     .name = "trace",
      .has_arg = 1,
      .flag = NULL,
       },
     {
-#define v4l2_opt       7
-     .name = "v4l2",
+#define metrics_opt     18
+     .name = "metrics",
      .has_arg = 1,
      .flag = NULL,
       },
     {
-#define size_opt       8
-     .name = "size",
+#define metrics_dump_opt        19
+     .name = "metrics-dump",
      .has_arg = 1,
      .flag = NULL,
       },
     {
-#define pixel_opt       9
-     .name = "pixel",
+#define control_opt     20
+     .name = "control",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define rate_opt        21
+     .name = "rate",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define osd_plane_opt   22
+     .name = "osd-plane",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define status_opt      23
+     .name = "status",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define writeback_opt   24
+     .name = "writeback",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define golden_opt      25
+     .name = "golden",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define dump_opt        26
+     .name = "dump",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define dump_frames_opt 27
+     .name = "dump-frames",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define errors_opt      28
+     .name = "errors",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define reopen_after_opt        29
+     .name = "reopen-after",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define mmap_opt        30
+     .name = "mmap",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define cpus_opt        31
+     .name = "cpus",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define decoder_cpus_opt        32
+     .name = "decoder-cpus",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define background_cpus_opt     33
+     .name = "background-cpus",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define sched_opt       34
+     .name = "sched",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define mlock_opt       35
+     .name = "mlock",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define match_rate_opt  36
+     .name = "match-rate",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define mode_opt        37
+     .name = "mode",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define vrr_opt         38
+     .name = "vrr",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define display_opt     39
+     .name = "display",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define backend_opt     40
+     .name = "backend",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define benchmark_opt   41
+     .name = "benchmark",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define bench_dir_opt   42
+     .name = "bench-dir",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define coordinator_opt 43
+     .name = "coordinator",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define share_opt       44
+     .name = "share",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define region_opt      45
+     .name = "region",
+     .has_arg = 1,
+     .flag = NULL,
+      },
+    {
+#define coordinator_mode_opt    46
+     .name = "coordinator-mode",
      .has_arg = 1,
      .flag = NULL,
       },
@@ -806,27 +5782,65 @@ static void usage(void)
     fprintf(stderr, "--v4l2=<value>    use v4l2 [0,1]\n");
     fprintf(stderr, "--size=<value>    size in pixels 1920x1080\n");
     fprintf(stderr, "--pixel=<value>   v4l2 pixel format [nv12,h264..]\n");
+    fprintf(stderr, "--profile=<name>  input profile [auto,legacy,low-latency]\n");
+    fprintf(stderr, "--probesize=<value>        probe size in bytes\n");
+    fprintf(stderr, "--analyzeduration=<value>  analyze duration in microseconds\n");
+    fprintf(stderr, "--buffers=<value> decoder capture buffers\n");
+    fprintf(stderr, "--threads=<value> decoder threads\n");
+    fprintf(stderr, "--mem-budget=<MiB>         dma-buf memory budget\n");
+    fprintf(stderr, "--mem-report=<seconds>     periodic memory report\n");
+    fprintf(stderr, "--trace=<file>    write a Chrome JSON trace on exit or SIGUSR1\n");
+    fprintf(stderr, "--metrics=<name>  publish live counters in /dev/shm/<name>\n");
+    fprintf(stderr, "--metrics-dump=<name>      print the counters of a running instance\n");
+    fprintf(stderr, "--control=<path>  control socket: load <url>, switch, pause, seek <seconds>, rate <n>, step\n");
+    fprintf(stderr, "--rate=<n>        trick play speed [2,4,16,-1,-16..]\n");
+    fprintf(stderr, "--osd-plane=<id>  ARGB plane for subtitles and status\n");
+    fprintf(stderr, "--status=<value>  show a status line on the OSD [0,1]\n");
+    fprintf(stderr, "--writeback=<file>        capture presented frames, write their CRC32 ('-': stdout)\n");
+    fprintf(stderr, "--golden=<file>   compare captured frames with a hash file\n");
+    fprintf(stderr, "--dump=<dir>      write captured frames as PPM\n");
+    fprintf(stderr, "--dump-frames=<list>      frames to dump: 0,25,100-200\n");
+    fprintf(stderr, "--errors=<policy> on decoder errors [resync,abort]\n");
+    fprintf(stderr, "--reopen-after=<n>        reopen the decoder after n failures in a row (0: never)\n");
+    fprintf(stderr, "--mmap=<value>    read local files through mmap [0,1]\n");
+    fprintf(stderr, "--cpus=<list>     CPUs of the playback thread: 4-7\n");
+    fprintf(stderr, "--decoder-cpus=<list>     CPUs of the decoder threads\n");
+    fprintf(stderr, "--background-cpus=<list>  CPUs of the pre-roll and release threads\n");
+    fprintf(stderr, "--sched=<policy>  playback thread policy [fifo,rr][:priority]\n");
+    fprintf(stderr, "--mlock=<value>   lock memory once playing [0,1]\n");
+    fprintf(stderr, "--match-rate=<value>      pick the mode refresh for the content frame rate [0,1]\n");
+    fprintf(stderr, "--mode=<WxH>      display resolution, e.g. 1920x1080\n");
+    fprintf(stderr, "--vrr=<value>     enable variable refresh rate when supported [0,1]\n");
+    fprintf(stderr, "--display=<name>  drm, or null to decode without displaying\n");
+    fprintf(stderr, "--backend=<name>  decoder choice without --codec [auto,software,rkmpp..]\n");
+    fprintf(stderr, "--benchmark=<list>        all, or codec:WxH[:depth],.. e.g. hevc:3840x2160:10\n");
+    fprintf(stderr, "--bench-dir=<dir> generated benchmark streams\n");
+    fprintf(stderr, "--coordinator=<path>      hold the display, show the frames of --share workers\n");
+    fprintf(stderr, "--share=<path>    send frames to a coordinator instead of opening the device\n");
+    fprintf(stderr, "--region=<WxH+X+Y>        where a --share worker is shown, default the whole screen\n");
+    fprintf(stderr, "--coordinator-mode=<octal>        permissions of the coordinator socket, e.g. 0660\n");
     fprintf(stderr, "\n");
 }
 
 
 int main(int argc, char *argv[])
 {
-    AVFormatContext *input_ctx = NULL;
-    AVStream *video = NULL;
-    int video_stream, ret, v4l2 = 0;
-    AVCodecContext *codec_ctx = NULL;
-    const AVCodec *codec;
-    AVFrame *frame;
+    int ret;
     AVPacket pkt;
     int lindex, opt;
-    unsigned int frame_width = 0, frame_height = 0;
-    char *codec_name = NULL, *video_name = NULL;
-    char *device_name = "/dev/dri/card0";
-    char *pixel_format = NULL, *size_window = NULL;
-    AVDictionary *opts = NULL;
-    AVCodecParameters *codecpar;
-    const AVInputFormat *ifmt = NULL;
+    char *video_name = NULL;
+    const char *bench_list = NULL, *bench_dir = "/tmp/ffmpeg-drm-bench";
+    int64_t t;
+    int rate = 1;
+
+    timing.start = monotonic_us();
+
+    config.device = "/dev/dri/card0";
+    config.profile = &input_profiles[0];
+    config.probesize = -1;
+    config.analyzeduration = -1;
+    config.capture_buffers = -1;
+    config.threads = -1;
 
     for (;;) {
         lindex = -1;
@@ -843,28 +5857,181 @@ int main(int argc, char *argv[])
             video_name = optarg;
             break;
         case codec_opt:
-            codec_name = optarg;
+            config.codec_name = optarg;
             break;
         case width_opt:
-            frame_width = atoi(optarg);
+            config.frame_width = atoi(optarg);
             break;
         case height_opt:
-            frame_height = atoi(optarg);
+            config.frame_height = atoi(optarg);
             break;
         case device_opt:
-            device_name = optarg;
+            config.device = optarg;
             break;
         case disable_plane_opt:
-            disable_plane_id = atoi(optarg);
+            osd_plane_id = atoi(optarg);
             break;
         case pixel_opt:
-            pixel_format = optarg;
+            config.pixel_format = optarg;
             break;
         case size_opt:
-            size_window = optarg;
+            config.size_window = optarg;
             break;
         case v4l2_opt:
-            v4l2 = atoi(optarg);
+            config.v4l2 = atoi(optarg);
+            break;
+        case profile_opt:
+            config.profile = find_input_profile(optarg);
+            if (!config.profile) {
+                err("Unknown profile '%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            break;
+        case probesize_opt:
+            config.probesize = atoll(optarg);
+            break;
+        case analyzeduration_opt:
+            config.analyzeduration = atoll(optarg);
+            break;
+        case buffers_opt:
+            config.capture_buffers = atoi(optarg);
+            break;
+        case threads_opt:
+            config.threads = atoi(optarg);
+            break;
+        case mem_budget_opt:
+            mem.budget = atoll(optarg) << 20;
+            break;
+        case mem_report_opt:
+            mem.report_interval = atoll(optarg) * 1000000;
+            break;
+        case trace_opt:
+            trace_file = optarg;
+            trace_enabled = _USE_TRACE_;
+            break;
+        case metrics_opt:
+            if (metrics_open(optarg))
+                exit(1);
+            break;
+        case metrics_dump_opt:
+            exit(metrics_dump(optarg));
+        case control_opt:
+            if (control_open(optarg))
+                exit(1);
+            break;
+        case rate_opt:
+            rate = atoi(optarg);
+            break;
+        case osd_plane_opt:
+            osd_plane_id = atoi(optarg);
+            break;
+        case status_opt:
+            osd.status_enabled = atoi(optarg);
+            break;
+        case writeback_opt:
+            wb.hash_file = optarg;
+            wb.enabled = 1;
+            break;
+        case golden_opt:
+            wb.golden_file = optarg;
+            wb.enabled = 1;
+            break;
+        case dump_opt:
+            wb.dump_dir = optarg;
+            wb.enabled = 1;
+            break;
+        case dump_frames_opt:
+            wb.dump_frames = optarg;
+            break;
+        case errors_opt:
+            if (!strcmp(optarg, "abort"))
+                resync.policy = ERRORS_ABORT;
+            else if (!strcmp(optarg, "resync"))
+                resync.policy = ERRORS_RESYNC;
+            else {
+                err("Unknown error policy '%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            break;
+        case reopen_after_opt:
+            resync.reopen_after = atoi(optarg);
+            break;
+        case mmap_opt:
+            config.mmap_io = atoi(optarg);
+            break;
+        case cpus_opt:
+        case decoder_cpus_opt:
+        case background_cpus_opt:
+            if (rt_parse_cpus(optarg, lindex == cpus_opt ? &rt.playback :
+                              lindex == decoder_cpus_opt ? &rt.decoder : &rt.background)) {
+                err("Invalid CPU list '%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            if (lindex == cpus_opt)
+                rt.has_playback = 1;
+            else if (lindex == decoder_cpus_opt)
+                rt.has_decoder = 1;
+            else
+                rt.has_background = 1;
+            break;
+        case sched_opt:
+            if (rt_parse_sched(optarg)) {
+                err("Invalid scheduling policy '%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            break;
+        case mlock_opt:
+            rt.mlock = atoi(optarg);
+            break;
+        case match_rate_opt:
+            modeset.match_rate = atoi(optarg);
+            break;
+        case mode_opt:
+            if (sscanf(optarg, "%ux%u", &modeset.width, &modeset.height) != 2 || !modeset.width || !modeset.height) {
+                err("Invalid mode '%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            break;
+        case vrr_opt:
+            modeset.vrr = atoi(optarg);
+            break;
+        case display_opt:
+            if (strcmp(optarg, "drm") && strcmp(optarg, "null")) {
+                err("Unknown display '%s'\n", optarg);
+                usage();
+                exit(1);
+            }
+            null_display = !strcmp(optarg, "null");
+            break;
+        case backend_opt:
+            config.backend = optarg;
+            break;
+        case benchmark_opt:
+            bench_list = optarg;
+            break;
+        case bench_dir_opt:
+            bench_dir = optarg;
+            break;
+        case coordinator_opt:
+            share.listen_path = optarg;
+            break;
+        case share_opt:
+            share.connect_path = optarg;
+            break;
+        case coordinator_mode_opt:
+            share.mode = strtol(optarg, NULL, 8) & 0777;
+            break;
+        case region_opt:
+            if (sscanf(optarg, "%ux%u+%d+%d", &share.w, &share.h, &share.x, &share.y) != 4 || !share.w || !share.h) {
+                err("Invalid region '%s'\n", optarg);
+                usage();
+                exit(1);
+            }
             break;
         default:
             usage();
@@ -876,141 +6043,165 @@ int main(int argc, char *argv[])
     // if (!frame_width || !frame_height || !codec_name || !video_name) {
     // if (!codec_name || !video_name) {
 #else
-    if (!video_name) {
+    if (!video_name && !bench_list && !share.listen_path) {
 #endif
         usage();
         exit(0);
     }
-    if (v4l2 && (!pixel_format || !size_window)) {
+    if (config.v4l2 && (!config.pixel_format || !config.size_window)) {
         usage();
         exit(0);
     }
 
+    /* a worker shows video only, the display belongs to the coordinator */
+    if (share.connect_path && (osd_plane_id || wb.enabled || modeset.match_rate || modeset.width || modeset.vrr)) {
+        err("--share cannot be combined with OSD, writeback or display mode options\n");
+        exit(1);
+    }
+    if (share.connect_path && share_connect(share.connect_path))
+        exit(1);
+
+    if (wb.enabled && wb_open())
+        exit(1);
+
+    rt_apply_playback();
+
+    if (trace_enabled) {
+        signal(SIGUSR1, trace_signal);
+        atexit(trace_dump);
+    }
+
+    if (share.listen_path)
+        return share_serve(config.device);
+
     //
     // register all formats and codecs
     // av_register_all();
     //
 
 #if _USE_V4L2_
-    if (v4l2)
+    if (config.v4l2)
         avdevice_register_all();
 #endif
 
-    if (v4l2) {
-	ifmt = av_find_input_format("video4linux2");
-	if (!ifmt) {
+    if (config.v4l2) {
+	config.ifmt = av_find_input_format("video4linux2");
+	if (!config.ifmt) {
     	    av_log(0, AV_LOG_ERROR, "Cannot find input format\n");
     	    exit(1);
 	}
     }
 
-    input_ctx = avformat_alloc_context();
-    if (!input_ctx)    {
-        err("Cannot allocate input format (Out of memory?)\n");
-        exit(1);
-    }
-
-    // Enable non-blocking mode
-    if (v4l2) {
-        input_ctx->flags |= AVFMT_FLAG_NONBLOCK;
-        //
-        // av_dict_set(&opts, "loglevel", "debug", 0);
-        //
-        av_dict_set(&opts, "input_format", pixel_format, 0);
-        av_dict_set(&opts, "video_size", size_window, 0);
-    }
-
-    /* open the input file */
-    if (avformat_open_input(&input_ctx, video_name, ifmt, &opts) != 0) {
-        fprintf(stderr, "Cannot open input file '%s'\n", video_name);
-        return -1;
-    }
-
-    if (avformat_find_stream_info(input_ctx, NULL) < 0) {
-        fprintf(stderr, "Cannot find input stream information.\n");
-        return -1;
-    }
-
-    /* find the video stream information */
-    ret = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &codec, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Cannot find a video stream in the input file\n");
-        return -1;
-    }
-    video_stream = ret;
-
-    /* set end of buffer to 0 (this ensures that no overreading happens for
-       damaged MPEG streams) */
-    // memset(inbuf + INBUF_SIZE, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    if (bench_list)
+        return bench_main(bench_list, bench_dir);
 
-    /* find the video decoder: ie: h264_rkmpp */
-    codecpar = input_ctx->streams[video_stream]->codecpar;
-    codec = avcodec_find_decoder(codecpar->codec_id);
-    if (!codec) {
-        err("Codec not found\n");
+    active = pipeline_alloc(video_name);
+    if (!active) {
+        err("Cannot allocate pipeline (Out of memory?)\n");
         exit(1);
     }
-
-    codec_ctx = avcodec_alloc_context3(codec);
-    if (!codec_ctx) {
-        err("Could not allocate video codec context\n");
+    if (pipeline_open(active, &config) < 0)
         exit(1);
-    }
-
-    video = input_ctx->streams[video_stream];
-    if (avcodec_parameters_to_context(codec_ctx, video->codecpar) < 0)
-        return -1;
-
-    /* For some codecs, such as msmpeg4 and mpeg4, width and height
-       MUST be initialized before opening the ffmpeg codec (ie, before
-       calling avcodec_open2) because this information is not available in
-       the bitstream). */
-    codec_ctx->pix_fmt = AV_PIX_FMT_DRM_PRIME;  /* request a DRM frame */
-    codec_ctx->coded_height = frame_height;
-    codec_ctx->coded_width = frame_width;
-    codec_ctx->get_format = get_format;
+    mem.capture_buffers = active->capture_buffers;
+    mem_add(&mem.pool, &mem.pool_peak, active->pool_bytes);
+    active->accounted = 1;
+    content_fps = active->fps;
 
-    av_dict_set(&opts, "num_capture_buffers", "32", 0);
-    /* open it */
-    if (avcodec_open2(codec_ctx, codec, &opts) < 0) {
-        err("Could not open codec\n");
+    if (rate != 1 && trick_set_rate(rate) < 0) {
+        err("Invalid rate %d\n", rate);
         exit(1);
     }
-    av_dict_free(&opts);
 
-    frame = av_frame_alloc();
-    if (!frame) {
-        err("Could not allocate video frame\n");
-        exit(1);
-    }
+    drm_buf_pool_init();
 
     /* actual decoding and dump the raw data */
     // frames = frame_count;
     ret = 0;
     while (ret >= 0) {
-        if ((ret = av_read_frame(input_ctx, &pkt)) < 0) {
+        if (trace_dump_requested)
+            trace_dump();
+
+        control_poll(paused && !step_frames ? 100 : 0);
+        pipeline_poll();
+        if (paused && !step_frames) {
+            osd_update(trick.last_pts);
+            osd_commit();
+            continue;
+        }
+
+        if (trick.rate < 0) {
+            ret = trick_reverse(config.device);
+            if (step_frames > 0)
+                step_frames--;
+            continue;
+        }
+        if (trick_keyframes_only())
+            trick_seek_ahead();
+
+        t = trace_begin();
+        if ((ret = av_read_frame(active->input_ctx, &pkt)) < 0) {
             if (ret == AVERROR(EAGAIN)) {
                ret = 0;
                continue;
             }
+            /* with a control socket the last picture stays up until told otherwise */
+            if (ret == AVERROR_EOF && control.listen_fd >= 0) {
+                decode_and_display(active->codec_ctx, active->frame, NULL, config.device);
+                avcodec_flush_buffers(active->codec_ctx);
+                paused = 1;
+                ret = 0;
+                continue;
+            }
+            /* network or I/O error: the demuxer resyncs by itself on the next read */
+            if (ret != AVERROR_EOF && resync.policy == ERRORS_RESYNC &&
+                ++resync.read_failures < RESYNC_MAX_READ_ERRORS) {
+                metrics_inc(read_errors);
+                resync.read_backoff = resync.read_backoff ?
+                    FFMIN(resync.read_backoff * 2, RESYNC_READ_BACKOFF_MAX) : RESYNC_READ_BACKOFF_MIN;
+                control_poll(resync.read_backoff);
+                ret = 0;
+                continue;
+            }
             break;
         }
-
-        if (video_stream == pkt.stream_index) {
-           ret = decode_and_display(codec_ctx, frame, &pkt, device_name);
+        resync.read_failures = 0;
+        resync.read_backoff = 0;
+        trace_end(TRACE_READ, t, pkt.pts);
+
+        /* keyframe mode: other pictures are never sent to the decoder */
+        if (active->video_stream == pkt.stream_index &&
+            (!trick_keyframes_only() || (pkt.flags & AV_PKT_FLAG_KEY)) && !resync_skip(&pkt)) {
+           timing_mark(first_packet);
+           metrics_packet(pkt.size);
+           ret = decode_and_display(active->codec_ctx, active->frame, &pkt, config.device);
+        } else if (active->sub_stream == pkt.stream_index) {
+            AVSubtitle sub;
+            int got_sub = 0;
+
+            if (avcodec_decode_subtitle2(active->sub_ctx, &sub, &got_sub, &pkt) >= 0 && got_sub)
+                osd_set_subtitle(&sub, active->sub_ctx->width, active->sub_ctx->height);
         }
         av_packet_unref(&pkt);
     }
-    /* flush the codec */
-    decode_and_display(codec_ctx, frame, NULL, device_name);
-    if (pdev->bufs[0])
-        drm_remove_fb(pdev->bufs[0]);
-    if (pdev->bufs[1])
-        drm_remove_fb(pdev->bufs[1]);
-
-    avformat_close_input(&input_ctx);
-    avcodec_free_context(&codec_ctx);
-    av_frame_free(&frame);
+    /* flush the codec, unless reopening it failed */
+    if (active->codec_ctx && avcodec_is_open(active->codec_ctx))
+        decode_and_display(active->codec_ctx, active->frame, NULL, config.device);
+    drm_release_bufs();
+    av_frame_free(&share.shown);
+    osd_free();
+    sw_free();
+    mem_report();
+    resync_report();
+    rt_report();
+    alloc_report();
+    if (pool_misses)
+        err("%u drm buffers taken from the heap, the pool is too small\n", pool_misses);
+
+    if (standby) {
+        atomic_store(&standby->abort, 1);
+        pipeline_free(standby);
+    }
+    pipeline_free(active);
 
-    return 0;
+    return wb_finish() ? WB_MISMATCH_EXIT : 0;
 }